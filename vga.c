@@ -5,7 +5,7 @@
 /* designated base vga memory address */
 #define VIDEO_BASE_ADDRESS  	0xA0000
 
-/* screen dimentions (320x200) */
+/* default screen dimentions (320x200) */
 #define SCREEN_WIDTH        	320  
 #define SCREEN_HEIGHT       	200
 
@@ -34,13 +34,317 @@
 #define VGA_NUM_REGS        	(1 + VGA_NUM_SEQ_REGS + VGA_NUM_CRTC_REGS + \
 				VGA_NUM_GC_REGS + VGA_NUM_AC_REGS)
 
+/* where each controller starts in a register table */
+#define VGA_SEQ_OFFSET          1
+#define VGA_CRTC_OFFSET         (VGA_SEQ_OFFSET + VGA_NUM_SEQ_REGS)
+#define VGA_GC_OFFSET           (VGA_CRTC_OFFSET + VGA_NUM_CRTC_REGS)
+#define VGA_AC_OFFSET           (VGA_GC_OFFSET + VGA_NUM_GC_REGS)
+
+/* 256 colors of 6 bit red, green and blue */
+#define VGA_DAC_SIZE            (256 * 3)
+
+/* text mode buffer, 80x50 with the 8x8 font */
+#define TEXT_BASE_ADDRESS       0xB8000
+#define TEXT_COLS               80
+#define TEXT_ROWS               50
+
 #define BLACK 			0x00
 #define WHITE 			0x3F
 
 #define FONT_SIZE 8
 
+/* canvas rows are stored in bands that stay a solid color until drawn on */
+#define BAND_HEIGHT 8
+
+/* occlusion backends used by set_pixel, the owner map is the default
+ * and VGA_SET_OCCLUSION switches between them */
+#define OCCLUSION_QUADTREE      0
+#define OCCLUSION_OWNER_MAP     1
+#define OCCLUSION_LINEAR_QTREE  2
+
+/* owner map slot 0 is the desktop and 255 marks a mixed tile,
+ * so 254 windows fit in a byte */
+#define DESKTOP_SLOT            0
+#define MAX_WINDOWS             254
+
+/* screen tiles used to classify compositing work */
+#define TILE_SIZE               8
+#define TILE_MIXED              0xFF
+
+/* commands beyond the base protocol in vga.h, their parameters
+ * travel in the VGA_WINDOW_MSG union like the others */
+#define VGA_MOVE_WINDOW         16
+#define VGA_DESTROY_WINDOW      17
+#define VGA_PRESENT             18
+#define VGA_SET_PRESENT         19
+#define VGA_BENCHMARK           20
+#define VGA_CREATE_CONSOLE      21
+#define VGA_CONSOLE_WRITE       22
+#define VGA_SCROLL              23
+#define VGA_CLEAR_CANVAS        24
+#define VGA_MINIMIZE            25
+#define VGA_SPRITE_DEFINE       26
+#define VGA_SPRITE_MOVE         27
+#define VGA_UPLOAD_BEGIN        28
+#define VGA_UPLOAD_ROWS         29
+#define VGA_UPLOAD_END          30
+#define VGA_DRAW_POLYGON        31
+#define VGA_DRAW_ELLIPSE        32
+#define VGA_QTREE_BENCHMARK     33
+#define VGA_SET_MODE            34
+#define VGA_SET_PALETTE         35
+#define VGA_TEXT_WRITE          36
+#define VGA_PRESENT_CLOCK       37
+#define VGA_SET_OCCLUSION       38
+
+/* set in cmd by vga_send so the driver can count the request off */
+#define VGA_MSG_COUNTED         0x8000
+
+/* display modes for VGA_SET_MODE */
+#define VGA_MODE_13H            0
+#define VGA_MODE_TEXT           1
+
+/* how a polygon is drawn */
+#define POLY_OUTLINE            0
+#define POLY_EVEN_ODD           1
+#define POLY_NONZERO            2
+
+/* overlay sprites drawn above every window */
+#define MAX_SPRITES             4
+#define MAX_SPRITE_SIZE         32
+
+/* how much of a window the owner map shows */
+#define VIS_FULL                0
+#define VIS_PARTIAL             1
+#define VIS_HIDDEN              2
+
+/* how damage reaches the screen */
+#define PRESENT_IMMEDIATE       0
+#define PRESENT_DEFERRED        1
+
+/* damage rectangles held between presents */
+#define MAX_DAMAGE              16
+
+/* requests the driver holds before replying */
+#define MAX_PENDING             32
+
+typedef struct _PARAM_VGA_MOVE_WINDOW {
+    int window_id;
+    int x;
+    int y;
+} PARAM_VGA_MOVE_WINDOW;
+
+typedef struct _PARAM_VGA_DESTROY_WINDOW {
+    int window_id;
+} PARAM_VGA_DESTROY_WINDOW;
+
+typedef struct _PARAM_VGA_SET_PRESENT {
+    int mode;
+    int interval;
+    int vsync;
+} PARAM_VGA_SET_PRESENT;
+
+typedef struct _PARAM_VGA_CREATE_CONSOLE {
+    char * title;
+    int x;
+    int y;
+    int cols;
+    int rows;
+    int window_id;
+} PARAM_VGA_CREATE_CONSOLE;
+
+typedef struct _PARAM_VGA_CONSOLE_WRITE {
+    int window_id;
+    char * text;
+    int fg_color;
+    int bg_color;
+} PARAM_VGA_CONSOLE_WRITE;
+
+typedef struct _PARAM_VGA_SCROLL {
+    int window_id;
+    short x;
+    short y;
+    short width;
+    short height;
+    short dx;
+    short dy;
+    int color;
+} PARAM_VGA_SCROLL;
+
+typedef struct _PARAM_VGA_CLEAR_CANVAS {
+    int window_id;
+    int color;
+} PARAM_VGA_CLEAR_CANVAS;
+
+typedef struct _PARAM_VGA_MINIMIZE {
+    int window_id;
+    int minimize;
+} PARAM_VGA_MINIMIZE;
+
+typedef struct _PARAM_VGA_SPRITE_DEFINE {
+    int sprite_id;
+    int width;
+    int height;
+    unsigned char * pixels;
+    int color_key;
+} PARAM_VGA_SPRITE_DEFINE;
+
+typedef struct _PARAM_VGA_SPRITE_MOVE {
+    int sprite_id;
+    int x;
+    int y;
+    int visible;
+} PARAM_VGA_SPRITE_MOVE;
+
+typedef struct _PARAM_VGA_UPLOAD_BEGIN {
+    int window_id;
+    int x;
+    int y;
+    int width;
+    int height;
+} PARAM_VGA_UPLOAD_BEGIN;
+
+typedef struct _PARAM_VGA_UPLOAD_ROWS {
+    int window_id;
+    unsigned char * pixels;
+    int count;
+} PARAM_VGA_UPLOAD_ROWS;
+
+typedef struct _PARAM_VGA_UPLOAD_END {
+    int window_id;
+} PARAM_VGA_UPLOAD_END;
+
+typedef struct _VGA_POINT {
+    short x;
+    short y;
+} VGA_POINT;
+
+typedef struct _PARAM_VGA_DRAW_POLYGON {
+    int window_id;
+    VGA_POINT * points;
+    int count;
+    int color;
+    int mode;
+} PARAM_VGA_DRAW_POLYGON;
+
+typedef struct _PARAM_VGA_DRAW_ELLIPSE {
+    int window_id;
+    short cx;
+    short cy;
+    short rx;
+    short ry;
+    int color;
+    int filled;
+} PARAM_VGA_DRAW_ELLIPSE;
+
+/* benchmark columns, in cycles for one full screen pass */
+#define BENCH_CLEAR             0
+#define BENCH_OWNER_MAP         1
+#define BENCH_QTREE_BUILD       2
+#define BENCH_COMPOSE_MAP       3
+#define BENCH_COMPOSE_QTREE     4
+#define BENCH_COLUMNS           5
+
+typedef struct _BENCH_RESULT {
+    int width;
+    int height;
+    int windows;
+    unsigned cycles[BENCH_COLUMNS];
+} BENCH_RESULT;
+
+typedef struct _PARAM_VGA_BENCHMARK {
+    BENCH_RESULT * results;
+    int max_results;
+    int count;
+} PARAM_VGA_BENCHMARK;
+
+/* pointer tree against linear tree, one result per window count */
+#define BENCH_QT_POINTER        0
+#define BENCH_QT_LINEAR         1
+
+typedef struct _QTREE_BENCH_RESULT {
+    int windows;
+    unsigned nodes[2];
+    unsigned bytes[2];
+    unsigned build_cycles[2];
+    unsigned lookup_cycles[2];
+    unsigned lookups;
+} QTREE_BENCH_RESULT;
+
+typedef struct _PARAM_VGA_QTREE_BENCHMARK {
+    QTREE_BENCH_RESULT * results;
+    int max_results;
+    int count;
+} PARAM_VGA_QTREE_BENCHMARK;
+
+typedef struct _PARAM_VGA_SET_MODE {
+    int mode;
+} PARAM_VGA_SET_MODE;
+
+typedef struct _PARAM_VGA_SET_PALETTE {
+    int first;
+    int count;
+    unsigned char * rgb;
+} PARAM_VGA_SET_PALETTE;
+
+typedef struct _PARAM_VGA_TEXT_WRITE {
+    int x;
+    int y;
+    char * text;
+    int attr;
+} PARAM_VGA_TEXT_WRITE;
+
+typedef struct _PARAM_VGA_SET_OCCLUSION {
+    int backend;
+} PARAM_VGA_SET_OCCLUSION;
+
+/* every register in write_regs order followed by the dac */
+typedef struct _VGA_STATE {
+    unsigned char regs[VGA_NUM_REGS];
+    unsigned char dac[VGA_DAC_SIZE];
+} VGA_STATE;
+
+/* linear framebuffer the compositor draws into */
+typedef struct _FRAMEBUFFER {
+    int width;
+    int height;
+    int stride;
+    int bpp;
+    MEM_ADDR base;
+} FRAMEBUFFER;
+
 int current_color = 0x01;
 
+int g_occlusion_backend = OCCLUSION_OWNER_MAP;
+
+/* set when the last quadtree build ran out of memory, the trees are then
+ * incomplete and show windows through what should cover them */
+int g_qtree_failed = 0;
+
+FRAMEBUFFER g_fb = { SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_WIDTH, 1, VIDEO_BASE_ADDRESS };
+
+int g_present_mode = PRESENT_IMMEDIATE;
+int g_present_interval = 1;
+int g_present_vsync = 0;
+
+/* the present clock is held unanswered while presents are immediate */
+int g_clock_parked = 0;
+PROCESS g_clock_sender;
+
+/* nonzero while bulk draws are being batched */
+int g_present_hold = 0;
+
+/* what the hardware holds, so only changed registers are written */
+VGA_STATE g_vga_shadow;
+int g_vga_shadow_valid = 0;
+
+/* graphics state parked while the text console is up */
+int g_vga_mode = VGA_MODE_13H;
+VGA_STATE g_vga_saved;
+
+/* the bios text colors, read at start up and loaded with the text console */
+unsigned char g_text_dac[VGA_DAC_SIZE];
+
 
 int g_window_id = 0;
 
@@ -61,6 +365,16 @@ typedef struct _QNODE {
 	struct _QNODE * se;
 } QNODE;
 
+/* quadtree flattened into an int array. node 0 is the root square at
+ * the frame origin, 0 is a visible leaf, -1 a hidden leaf and anything
+ * else the index of four contiguous children in nw ne sw se order */
+typedef struct _LQTREE {
+    int * nodes;
+    int count;
+    int capacity;
+    int size;
+} LQTREE;
+
 typedef struct _FRAME {
 	BOUND bound;
 	char * title;
@@ -68,24 +382,146 @@ typedef struct _FRAME {
 
 typedef struct _CANVAS {
 	BOUND bound;
-	int * buffer;
+	int bands;
+	/* color of each band while it has no pixel storage */
+	int * band_color;
+	/* width * BAND_HEIGHT pixels per band, NULL while solid */
+	int ** band_buffer;
 } CANVAS;
 
+typedef struct _CELL {
+	char c;
+	unsigned char fg;
+	unsigned char bg;
+	unsigned char dirty;
+} CELL;
+
+typedef struct _CONSOLE {
+	int cols;
+	int rows;
+	int cursor_x;
+	int cursor_y;
+	CELL * cells;
+	/* dirty columns of each row, clean when lo > hi */
+	int * dirty_lo;
+	int * dirty_hi;
+} CONSOLE;
+
+typedef struct _UPLOAD {
+	int active;
+	/* target area in canvas coordinates */
+	BOUND bound;
+	/* next pixel to be written */
+	int row;
+	int col;
+	/* rows already damaged */
+	int flushed;
+} UPLOAD;
+
+/* polygon edge stepped one scanline at a time, its crossing is
+ * x + r / den with den twice the edge height */
+typedef struct _EDGE {
+    int y0;
+    int y1;
+    int x;
+    int r;
+    int step_x;
+    int step_r;
+    int den;
+    int dir;
+    int key;
+} EDGE;
+
 typedef struct _VGA_WINDOW {
 	int id;
+	int slot;
 	FRAME frame;
 	CANVAS canvas;
     int color;
 	QNODE * root;
+	LQTREE lq;
+	CONSOLE * console;
+	int visibility;
+	int minimized;
+	UPLOAD upload;
 	struct _VGA_WINDOW * next;
     struct _VGA_WINDOW * prev;
 } VGA_WINDOW;
 
+typedef struct _SPRITE {
+	int defined;
+	int visible;
+	/* drawn on the framebuffer right now */
+	int shown;
+	BOUND bound;
+	int color_key;
+	unsigned char pixels[MAX_SPRITE_SIZE * MAX_SPRITE_SIZE];
+	/* what the opaque pixels cover while shown */
+	int save_under[MAX_SPRITE_SIZE * MAX_SPRITE_SIZE];
+} SPRITE;
+
+/* what a benchmark parks while it runs on its own stack */
+typedef struct _BENCH_STATE {
+    FRAMEBUFFER fb;
+    VGA_WINDOW * head;
+    VGA_WINDOW * tail;
+    int backend;
+    int mode;
+    int sprites_suspended;
+} BENCH_STATE;
+
 VGA_WINDOW * window_list_head;
 VGA_WINDOW * window_list_tail;
 
+/* benchmark results nothing reads, so the timed loops stay in */
+int g_bench_sink = 0;
+
+/* index of the topmost window covering each screen pixel, sized
+ * for the framebuffer by set_framebuffer */
+unsigned char * owner_map = NULL;
+VGA_WINDOW * window_slots[MAX_WINDOWS + 1];
+
+/* owner of every pixel in an 8x8 screen tile, or TILE_MIXED */
+unsigned char * tile_owner = NULL;
+int g_tiles_x = 0;
+int g_tiles_y = 0;
+
+/* screen areas waiting to be composited, never overlapping */
+BOUND damage_list[MAX_DAMAGE];
+int damage_count = 0;
+
+typedef struct _VGA_REQUEST {
+    PROCESS sender;
+    VGA_WINDOW_MSG * msg;
+} VGA_REQUEST;
+
+/* interactive requests, bulk draws not yet applied, and bulk draws
+ * applied but not yet replied to */
+VGA_REQUEST high_queue[MAX_PENDING];
+VGA_REQUEST bulk_queue[MAX_PENDING];
+VGA_REQUEST done_queue[MAX_PENDING];
+int high_count = 0;
+int bulk_count = 0;
+int done_count = 0;
+
+/* sprites in drawing order, lowest first */
+SPRITE sprites[MAX_SPRITES];
+
+/* covers every shown sprite while g_sprites_shown is set */
+int g_sprites_shown = 0;
+BOUND g_sprite_bound;
+
+/* keeps sprites off framebuffers that are not the screen */
+int g_sprites_suspended = 0;
+
+/* set_pixel never writes outside of this */
+BOUND g_clip = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+
 PORT vga_port;
 
+/* requests announced by vga_send that the driver has not received yet */
+volatile int g_vga_pending = 0;
+
 /***************************************************************
  *                     Function Prototypes                     *
  ***************************************************************/
@@ -94,8 +530,57 @@ PORT vga_port;
 
 void vga_process ();
 
+void vga_present_process ();
+
+void vga_bench (PROCESS proc, PARAM param);
+
+char * bench_field(char * buf, unsigned v, int width);
+
+void vga_dispatch (VGA_WINDOW_MSG * msg);
+
+int is_interactive (int cmd);
+
+int vga_port_pending ();
+
+/* the client call for every request to vga_port, see vga_send */
+void vga_send (VGA_WINDOW_MSG * msg);
+
+VGA_WINDOW_MSG * vga_receive (PROCESS * sender);
+
+void queue_request (PROCESS sender, VGA_WINDOW_MSG * msg);
+
+VGA_REQUEST dequeue_request (VGA_REQUEST * queue, int * count);
+
+void reply_done ();
+
 void write_regs (unsigned char * regs);
 
+void vga_write_misc (unsigned char v);
+
+void vga_write_seq (int index, unsigned char v);
+
+void vga_write_crtc (int index, unsigned char v);
+
+void vga_write_gc (int index, unsigned char v);
+
+void vga_set_dac (int first, int count, unsigned char * rgb);
+
+void vga_read_state (VGA_STATE * state);
+
+void vga_save_state (VGA_STATE * state);
+
+void vga_restore_state (VGA_STATE * state);
+
+void load_text_font ();
+
+void set_mode(PARAM_VGA_SET_MODE * params);
+
+void set_palette(PARAM_VGA_SET_PALETTE * params);
+
+void text_write(PARAM_VGA_TEXT_WRITE * params);
+
+void set_occlusion(PARAM_VGA_SET_OCCLUSION * params);
+
 void create_window ( PARAM_VGA_CREATE_WINDOW * params);
 
 void draw_pixel (PARAM_VGA_DRAW_PIXEL * params);
@@ -106,24 +591,108 @@ void draw_text (PARAM_VGA_DRAW_TEXT * params);
 
 void change_window(PARAM_VGA_CHANGE_FOCUS * params);
 
+void move_window(PARAM_VGA_MOVE_WINDOW * params);
+
+void destroy_window(PARAM_VGA_DESTROY_WINDOW * params);
+
+void set_present(PARAM_VGA_SET_PRESENT * params);
+
+void create_console(PARAM_VGA_CREATE_CONSOLE * params);
+
+void console_write(PARAM_VGA_CONSOLE_WRITE * params);
+
+void scroll_canvas(PARAM_VGA_SCROLL * params);
+
+void scroll_region(VGA_WINDOW * wnd, BOUND r, int dx, int dy, int color);
+
+void clear_canvas(PARAM_VGA_CLEAR_CANVAS * params);
+
+void minimize_window(PARAM_VGA_MINIMIZE * params);
+
+void define_sprite(PARAM_VGA_SPRITE_DEFINE * params);
+
+void move_sprite(PARAM_VGA_SPRITE_MOVE * params);
+
+void upload_begin(PARAM_VGA_UPLOAD_BEGIN * params);
+
+void upload_rows(PARAM_VGA_UPLOAD_ROWS * params);
+
+void upload_end(PARAM_VGA_UPLOAD_END * params);
+
+void draw_polygon(PARAM_VGA_DRAW_POLYGON * params);
+
+void draw_ellipse(PARAM_VGA_DRAW_ELLIPSE * params);
+
+void run_benchmark(PARAM_VGA_BENCHMARK * params);
+
+void run_qtree_benchmark(PARAM_VGA_QTREE_BENCHMARK * params);
+
+void bench_enter(BENCH_STATE * saved);
+
+void bench_leave(BENCH_STATE * saved);
+
+VGA_WINDOW * bench_add_window(unsigned * seed, int width, int height, BOUND * area);
+
+void bench_clear_stack();
+
+int set_framebuffer(FRAMEBUFFER * fb);
+
+BOUND screen_bound();
+
+unsigned long long read_tsc();
+
 void clear_screen();
 
 void set_pixel (VGA_WINDOW * window, int x, int y, int color);
 
 void poke_pixel (int x, int y, int color);
 
-void vga_draw_canvas(VGA_WINDOW * window);
+void poke_raw (int x, int y, int color);
+
+int peek_raw (int x, int y);
+
+void poke_canvas_span (int x, int y, int * src, int n);
+
+void fill_span (int x, int y, int n, int color);
+
+void fb_move (MEM_ADDR dst, MEM_ADDR src, int n);
+
+void screen_move_rect (BOUND * src, int dx, int dy);
+
+void vga_draw_canvas_rect(VGA_WINDOW * window, BOUND * r);
 
 void vga_draw_frame(VGA_WINDOW * window);
 
-void vga_draw_window(VGA_WINDOW * window);
+void vga_compose_rect(BOUND * r);
 
-void vga_render_windows();
+void vga_compose_clip_per_pixel();
 
 int get_canvas_pixel(VGA_WINDOW * wnd, int x, int y);
 
 void set_canvas_pixel(VGA_WINDOW * wnd, int x, int y, int color);
 
+int init_canvas(VGA_WINDOW * wnd, int color);
+
+void destroy_canvas(VGA_WINDOW * wnd);
+
+int * canvas_row(VGA_WINDOW * wnd, int y);
+
+int canvas_row_solid(VGA_WINDOW * wnd, int y);
+
+void canvas_copy_row(VGA_WINDOW * wnd, int dst_x, int dst_y, int src_x, int src_y, int n);
+
+void canvas_reverse_bands(VGA_WINDOW * wnd, int first, int last);
+
+void canvas_move_rows(VGA_WINDOW * wnd, int dst_y, int src_y, int count);
+
+void canvas_move_rect(VGA_WINDOW * wnd, BOUND * src, int dst_x, int dst_y);
+
+void canvas_fill_rect(VGA_WINDOW * wnd, BOUND * r, int color);
+
+void move_ints(int * dst, int * src, int n);
+
+int bound_owned_by(VGA_WINDOW * wnd, BOUND * b);
+
 VGA_WINDOW * get_window(int id);
 
 void draw_character (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, char c);
@@ -132,6 +701,18 @@ void draw_string (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, co
 
 int m_abs (int a);
 
+void raster_line (VGA_WINDOW * wnd, int x0, int y0, int x1, int y1, int color);
+
+void canvas_span (VGA_WINDOW * wnd, int x0, int x1, int y, int color);
+
+void edge_init (EDGE * e, VGA_POINT * a, VGA_POINT * b);
+
+void edge_step (EDGE * e);
+
+void fill_polygon (VGA_WINDOW * wnd, VGA_POINT * points, int count, int color, int nonzero);
+
+void raster_ellipse (VGA_WINDOW * wnd, int cx, int cy, int rx, int ry, int color, int filled);
+
 /* quadtree functions */
 
 BOUND create_bound(int x, int y, int width, int height);
@@ -158,8 +739,92 @@ int bound_contains_within(BOUND * in, BOUND * out);
 
 void add_window_to_list(VGA_WINDOW * w);
 
+void remove_window_from_list(VGA_WINDOW * w);
+
+void bring_window_forward(int window_id);
+
+void reset_root(QNODE * root);
+
+void reset_qtrees();
+
+void release_qtrees();
+
 void build_quadtrees();
 
+void set_occlusion_backend(int backend);
+
+/* linear quadtree functions */
+
+int lq_alloc(LQTREE * t, int n);
+
+void lq_build_node(LQTREE * t, int node, int x, int y, int size, BOUND * occ, int n);
+
+void lq_build(VGA_WINDOW * w);
+
+void lq_release(VGA_WINDOW * w);
+
+int search_lqtree(VGA_WINDOW * w, int x, int y);
+
+void build_lqtrees();
+
+void release_lqtrees();
+
+int count_qnodes(QNODE * q);
+
+/* console functions */
+
+void console_put(VGA_WINDOW * wnd, char c, int fg, int bg);
+
+void console_newline(VGA_WINDOW * wnd);
+
+void console_flush(VGA_WINDOW * wnd);
+
+void destroy_console(CONSOLE * con);
+
+/* owner map functions */
+
+int alloc_window_slot(VGA_WINDOW * w);
+
+void free_window_slot(int slot);
+
+void owner_map_fill(BOUND * b, int slot);
+
+void owner_map_repaint(BOUND * b);
+
+void owner_map_write(BOUND * b, int slot);
+
+void tile_map_update(BOUND * b);
+
+void update_visibility(BOUND * b);
+
+/* sprite functions */
+
+void sprites_hide();
+
+void sprites_show();
+
+int sprite_capture(int x, int y, int color);
+
+int sprites_cover_span(int x, int y, int n);
+
+int count_owned(VGA_WINDOW * wnd, BOUND * b);
+
+/* damage functions */
+
+int bound_touches(BOUND * a, BOUND * b);
+
+BOUND get_union(BOUND * a, BOUND * b);
+
+void add_damage(BOUND * b);
+
+void damage_canvas(VGA_WINDOW * wnd, int x, int y, int width, int height);
+
+void vga_present();
+
+int damage_intersects(BOUND * b);
+
+void wait_vretrace();
+
 /***************************************************************
  *                          INIT VGA                           *
  ***************************************************************/
@@ -187,12 +852,27 @@ int init_vga()
         0x41, 0x00, 0x0F, 0x00, 0x00
     };
 
+    FRAMEBUFFER vga_fb = { SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_WIDTH, 1, VIDEO_BASE_ADDRESS };
+
+    /* learn what the bios left behind, then only write the difference */
+    vga_read_state(&g_vga_shadow);
+    g_vga_shadow_valid = 1;
+    for(int i = 0; i < VGA_DAC_SIZE; i++)
+        g_text_dac[i] = g_vga_shadow.dac[i];
+
     /* set to vga 256 color mode */
     write_regs(g_320x200x256);
 
+    /* size the owner map and tiles for the screen */
+    if(!set_framebuffer(&vga_fb))
+        return 0;
+
     /* create vga driver process */
     vga_port = create_process(vga_process, 5, 0, "VGA");
 
+    /* create compositor clock for deferred presents */
+    create_process(vga_present_process, 5, 0, "VGA present");
+
     /* get rid of junk in memory */
     clear_screen();
 
@@ -209,676 +889,3352 @@ void vga_process (PROCESS proc, PARAM param)
 
     VGA_WINDOW_MSG * msg;
     PROCESS sender;
+    VGA_REQUEST req;
 
     /* wait for messages */
     while (1)
     {
-        
-        /* get message from sending process */
-        msg = (VGA_WINDOW_MSG *) receive(&sender);
 
-        /* process request from message */
-        switch (msg->cmd)
+        /* take everything already queued on the port without blocking */
+        while (vga_port_pending() &&
+            high_count < MAX_PENDING && bulk_count < MAX_PENDING)
         {
+            msg = vga_receive(&sender);
+            queue_request(sender, msg);
+        }
 
-            case VGA_CREATE_WINDOW:
-                create_window( (PARAM_VGA_CREATE_WINDOW *) &msg->u.create_window );
-                break;
-
-            case VGA_DRAW_TEXT:
-                draw_text( (PARAM_VGA_DRAW_TEXT *) &msg->u.draw_text );
-                break;
-
-            case VGA_DRAW_PIXEL:
-                draw_pixel( (PARAM_VGA_DRAW_PIXEL *) &msg->u.draw_pixel );
-                break;
+        /* interactive requests go first and are answered at once */
+        if (high_count > 0)
+        {
+            req = dequeue_request(high_queue, &high_count);
+            vga_dispatch(req.msg);
+            reply(req.sender);
+            continue;
+        }
 
-            case VGA_DRAW_LINE:
-                draw_line( (PARAM_VGA_DRAW_LINE *) &msg->u.draw_line );
-                break;
+        /* apply one bulk draw and look for new arrivals again, its
+         * present and reply wait until the batch is done */
+        if (bulk_count > 0 && done_count < MAX_PENDING)
+        {
+            req = dequeue_request(bulk_queue, &bulk_count);
+            g_present_hold = 1;
+            vga_dispatch(req.msg);
+            g_present_hold = 0;
+            done_queue[done_count++] = req;
+            continue;
+        }
 
-            case VGA_CHANGE_FOCUS:
-                change_window( (PARAM_VGA_CHANGE_FOCUS *) &msg->u.change_focus );
-                break;
+        if (done_count > 0)
+        {
+            reply_done();
+            continue;
         }
 
-        /* reply to sender */
-        reply(sender);
+        /* get message from sending process */
+        msg = vga_receive(&sender);
+        queue_request(sender, msg);
     }
 }
 
-/**************************************************************
- *               WRITE TO THE VGA REGISTERS                   *
- *************************************************************/
-
-void write_regs (unsigned char * regs)
+void vga_dispatch (VGA_WINDOW_MSG * msg)
 {
-    unsigned int i;
-
-    /* write MISCELLANEOUS reg */
-    outportb (VGA_MISC_WRITE, *(regs++));
-    
-    /* write SEQUENCER regs */
-    for (i = 0; i < VGA_NUM_SEQ_REGS; i++)
+    switch (msg->cmd)
     {
-        outportb (VGA_SEQ_INDEX, i);
-        outportb (VGA_SEQ_DATA, *(regs++));
-    }
 
-    /* unlock CRTC registers */
-    outportb (VGA_CRTC_INDEX, 0x03);
-    outportb (VGA_CRTC_DATA, inportb (VGA_CRTC_DATA) | 0x80);
-    outportb (VGA_CRTC_INDEX, 0x11);
-    outportb (VGA_CRTC_DATA, inportb (VGA_CRTC_DATA) & ~0x80);
+        case VGA_CREATE_WINDOW:
+            create_window( (PARAM_VGA_CREATE_WINDOW *) &msg->u.create_window );
+            break;
 
-    /* make sure they remain unlocked */
-    regs[0x03] |= 0x80;
-    regs[0x11] &= ~0x80;
+        case VGA_DRAW_TEXT:
+            draw_text( (PARAM_VGA_DRAW_TEXT *) &msg->u.draw_text );
+            break;
 
-    /* write CRTC regs */
-    for (i = 0; i < VGA_NUM_CRTC_REGS; i++)
-    {
-        outportb (VGA_CRTC_INDEX, i);
-        outportb (VGA_CRTC_DATA, *(regs++));
-    }
+        case VGA_DRAW_PIXEL:
+            draw_pixel( (PARAM_VGA_DRAW_PIXEL *) &msg->u.draw_pixel );
+            break;
 
-    /* write GRAPHICS CONTROLLER regs */
-    for (i = 0; i < VGA_NUM_GC_REGS; i++)
-    {
-        outportb (VGA_GC_INDEX, i);
-        outportb (VGA_GC_DATA, *(regs++));
-    }
+        case VGA_DRAW_LINE:
+            draw_line( (PARAM_VGA_DRAW_LINE *) &msg->u.draw_line );
+            break;
 
-    /* write ATTRIBUTE CONTROLLER regs */
-    for (i = 0; i < VGA_NUM_AC_REGS; i++)
-    {
-        (void) inportb (VGA_INSTAT_READ);
-        outportb (VGA_AC_INDEX, i);
-        outportb (VGA_AC_WRITE, *(regs++));
-    }
+        case VGA_CHANGE_FOCUS:
+            change_window( (PARAM_VGA_CHANGE_FOCUS *) &msg->u.change_focus );
+            break;
 
-    /* lock 16-color palette and unblank display */
-    (void) inportb (VGA_INSTAT_READ);
-    outportb (VGA_AC_INDEX, 0x20);
-}
+        case VGA_MOVE_WINDOW:
+            move_window( (PARAM_VGA_MOVE_WINDOW *) &msg->u );
+            break;
 
-/**************************************************************
- *                   API : CREATE WINDOW                      *
- *************************************************************/
+        case VGA_DESTROY_WINDOW:
+            destroy_window( (PARAM_VGA_DESTROY_WINDOW *) &msg->u );
+            break;
 
-void create_window ( PARAM_VGA_CREATE_WINDOW * params)
-{
-	VGA_WINDOW * window = malloc( sizeof(VGA_WINDOW) );
-	window->id = g_window_id++;
-	params->window_id = window->id;
-	window->frame.bound.x = params->x-1;
-	window->frame.bound.y = params->y-10;
-	window->frame.bound.width = params->width+2;
-	window->frame.bound.height = params->height+11;
-	window->canvas.bound.x = params->x;
-	window->canvas.bound.y = params->y;
-	window->canvas.bound.width = params->width;
-	window->canvas.bound.height = params->height;
-    window->canvas.buffer = malloc(
-        sizeof(int) * (window->canvas.bound.width) * (window->canvas.bound.height));
-    window->color = current_color++;
+        case VGA_PRESENT:
+        case VGA_PRESENT_CLOCK:
+            vga_present();
+            break;
 
-    int bound_size = 1;
-    while (bound_size < window->frame.bound.width ||
-        bound_size < window->frame.bound.height) 
-        {
-            bound_size *= 2;
-        }
+        case VGA_SET_PRESENT:
+            set_present( (PARAM_VGA_SET_PRESENT *) &msg->u );
+            break;
 
-	window->root = create_qnode(
-        window->frame.bound.x, 
-        window->frame.bound.y, 
-        bound_size, 
-        bound_size);
+        case VGA_BENCHMARK:
+            run_benchmark( (PARAM_VGA_BENCHMARK *) &msg->u );
+            break;
 
-    window->next = NULL;
+        case VGA_CREATE_CONSOLE:
+            create_console( (PARAM_VGA_CREATE_CONSOLE *) &msg->u );
+            break;
+
+        case VGA_CONSOLE_WRITE:
+            console_write( (PARAM_VGA_CONSOLE_WRITE *) &msg->u );
+            break;
+
+        case VGA_SCROLL:
+            scroll_canvas( (PARAM_VGA_SCROLL *) &msg->u );
+            break;
+
+        case VGA_CLEAR_CANVAS:
+            clear_canvas( (PARAM_VGA_CLEAR_CANVAS *) &msg->u );
+            break;
+
+        case VGA_MINIMIZE:
+            minimize_window( (PARAM_VGA_MINIMIZE *) &msg->u );
+            break;
+
+        case VGA_SPRITE_DEFINE:
+            define_sprite( (PARAM_VGA_SPRITE_DEFINE *) &msg->u );
+            break;
+
+        case VGA_SPRITE_MOVE:
+            move_sprite( (PARAM_VGA_SPRITE_MOVE *) &msg->u );
+            break;
+
+        case VGA_UPLOAD_BEGIN:
+            upload_begin( (PARAM_VGA_UPLOAD_BEGIN *) &msg->u );
+            break;
+
+        case VGA_UPLOAD_ROWS:
+            upload_rows( (PARAM_VGA_UPLOAD_ROWS *) &msg->u );
+            break;
+
+        case VGA_UPLOAD_END:
+            upload_end( (PARAM_VGA_UPLOAD_END *) &msg->u );
+            break;
+
+        case VGA_DRAW_POLYGON:
+            draw_polygon( (PARAM_VGA_DRAW_POLYGON *) &msg->u );
+            break;
+
+        case VGA_DRAW_ELLIPSE:
+            draw_ellipse( (PARAM_VGA_DRAW_ELLIPSE *) &msg->u );
+            break;
+
+        case VGA_QTREE_BENCHMARK:
+            run_qtree_benchmark( (PARAM_VGA_QTREE_BENCHMARK *) &msg->u );
+            break;
+
+        case VGA_SET_MODE:
+            set_mode( (PARAM_VGA_SET_MODE *) &msg->u );
+            break;
+
+        case VGA_SET_PALETTE:
+            set_palette( (PARAM_VGA_SET_PALETTE *) &msg->u );
+            break;
+
+        case VGA_TEXT_WRITE:
+            text_write( (PARAM_VGA_TEXT_WRITE *) &msg->u );
+            break;
+
+        case VGA_SET_OCCLUSION:
+            set_occlusion( (PARAM_VGA_SET_OCCLUSION *) &msg->u );
+            break;
+    }
+}
+
+int is_interactive (int cmd)
+{
+    switch (cmd)
+    {
+        case VGA_DRAW_TEXT:
+        case VGA_DRAW_PIXEL:
+        case VGA_DRAW_LINE:
+        case VGA_CONSOLE_WRITE:
+        case VGA_SCROLL:
+        case VGA_CLEAR_CANVAS:
+        case VGA_UPLOAD_BEGIN:
+        case VGA_UPLOAD_ROWS:
+        case VGA_UPLOAD_END:
+        case VGA_DRAW_POLYGON:
+        case VGA_DRAW_ELLIPSE:
+        case VGA_BENCHMARK:
+        case VGA_QTREE_BENCHMARK:
+            return 0;
+    }
+    return 1;
+}
+
+/* true while a vga_send is on its way, requests sent with a plain send
+ * are still served but wait until the queues run dry */
+int vga_port_pending ()
+{
+    return g_vga_pending > 0;
+}
+
+/* sends msg to the driver, counting it first so the driver knows to
+ * take it into the current batch. clients must use this instead of
+ * send(vga_port, ...), the kernel gives no way to peek at a port so
+ * uncounted requests cannot be seen until the driver blocks again */
+void vga_send (VGA_WINDOW_MSG * msg)
+{
+    volatile int flag;
+
+    DISABLE_INTR(flag);
+    g_vga_pending++;
+    ENABLE_INTR(flag);
+    msg->cmd |= VGA_MSG_COUNTED;
+    send(vga_port, msg);
+}
+
+VGA_WINDOW_MSG * vga_receive (PROCESS * sender)
+{
+    VGA_WINDOW_MSG * msg = (VGA_WINDOW_MSG *) receive(sender);
+
+    if (msg->cmd & VGA_MSG_COUNTED)
+    {
+        volatile int flag;
+
+        msg->cmd &= ~VGA_MSG_COUNTED;
+        DISABLE_INTR(flag);
+        g_vga_pending--;
+        ENABLE_INTR(flag);
+    }
+    return msg;
+}
+
+void queue_request (PROCESS sender, VGA_WINDOW_MSG * msg)
+{
+    VGA_REQUEST req;
+    req.sender = sender;
+    req.msg = msg;
+
+    /* immediate mode has nothing for the clock to do, it stays blocked
+     * in its send until set_present switches to deferred */
+    if (msg->cmd == VGA_PRESENT_CLOCK && g_present_mode == PRESENT_IMMEDIATE)
+    {
+        g_clock_sender = sender;
+        g_clock_parked = 1;
+        return;
+    }
+
+    if (is_interactive(msg->cmd))
+        high_queue[high_count++] = req;
+    else
+        bulk_queue[bulk_count++] = req;
+}
+
+VGA_REQUEST dequeue_request (VGA_REQUEST * queue, int * count)
+{
+    VGA_REQUEST req = queue[0];
+
+    (*count)--;
+    for (int i = 0; i < *count; i++)
+        queue[i] = queue[i + 1];
+
+    return req;
+}
+
+/* a sender stays blocked until its batch is replied to, so a busy
+ * client gets one draw into each batch, the same as everyone else */
+void reply_done ()
+{
+    if (g_present_mode == PRESENT_IMMEDIATE)
+        vga_present();
+
+    for (int i = 0; i < done_count; i++)
+        reply(done_queue[i].sender);
+    done_count = 0;
+}
+
+/* asks the driver for a present every interval while damage is pending,
+ * in immediate mode the driver holds its request so it sleeps blocked */
+void vga_present_process (PROCESS proc, PARAM param)
+{
+    VGA_WINDOW_MSG msg;
+
+    while (1)
+    {
+        if (g_present_mode == PRESENT_DEFERRED && damage_count == 0)
+        {
+            sleep(g_present_interval);
+            continue;
+        }
+
+        msg.cmd = VGA_PRESENT_CLOCK;
+        vga_send(&msg);
+        sleep(g_present_interval);
+    }
+}
+
+/**************************************************************
+ *               WRITE TO THE VGA REGISTERS                   *
+ *************************************************************/
+
+void write_regs (unsigned char * regs)
+{
+    unsigned int i;
+    int ac_changed = 0;
+
+    /* write MISCELLANEOUS reg */
+    vga_write_misc(regs[0]);
+    
+    /* write SEQUENCER regs */
+    for (i = 0; i < VGA_NUM_SEQ_REGS; i++)
+        vga_write_seq(i, regs[VGA_SEQ_OFFSET + i]);
+
+    /* unlock CRTC registers first, vga_write_crtc keeps them unlocked */
+    vga_write_crtc(0x11, regs[VGA_CRTC_OFFSET + 0x11]);
+    vga_write_crtc(0x03, regs[VGA_CRTC_OFFSET + 0x03] | 0x80);
+
+    /* write CRTC regs */
+    for (i = 0; i < VGA_NUM_CRTC_REGS; i++)
+    {
+        if (i == 0x03)
+            continue;
+        vga_write_crtc(i, regs[VGA_CRTC_OFFSET + i]);
+    }
+
+    /* write GRAPHICS CONTROLLER regs */
+    for (i = 0; i < VGA_NUM_GC_REGS; i++)
+        vga_write_gc(i, regs[VGA_GC_OFFSET + i]);
+
+    /* write ATTRIBUTE CONTROLLER regs, resetting the flip-flop once since
+     * every index and data pair leaves it back at the index */
+    for (i = 0; i < VGA_NUM_AC_REGS; i++)
+    {
+        unsigned char v = regs[VGA_AC_OFFSET + i];
+        if (g_vga_shadow_valid && g_vga_shadow.regs[VGA_AC_OFFSET + i] == v)
+            continue;
+
+        if (!ac_changed)
+            (void) inportb (VGA_INSTAT_READ);
+        ac_changed = 1;
+
+        outportb (VGA_AC_INDEX, i);
+        outportb (VGA_AC_WRITE, v);
+        g_vga_shadow.regs[VGA_AC_OFFSET + i] = v;
+    }
+
+    /* lock 16-color palette and unblank display */
+    if (ac_changed)
+        outportb (VGA_AC_INDEX, 0x20);
+}
+
+void vga_write_misc (unsigned char v)
+{
+    if (g_vga_shadow_valid && g_vga_shadow.regs[0] == v)
+        return;
+
+    outportb (VGA_MISC_WRITE, v);
+    g_vga_shadow.regs[0] = v;
+}
+
+void vga_write_seq (int index, unsigned char v)
+{
+    if (g_vga_shadow_valid && g_vga_shadow.regs[VGA_SEQ_OFFSET + index] == v)
+        return;
+
+    outportb (VGA_SEQ_INDEX, index);
+    outportb (VGA_SEQ_DATA, v);
+    g_vga_shadow.regs[VGA_SEQ_OFFSET + index] = v;
+}
+
+/* the protect bit in 0x11 is never set, so 0-7 stay writable */
+void vga_write_crtc (int index, unsigned char v)
+{
+    if (index == 0x11)
+        v &= ~0x80;
+
+    if (g_vga_shadow_valid && g_vga_shadow.regs[VGA_CRTC_OFFSET + index] == v)
+        return;
+
+    outportb (VGA_CRTC_INDEX, index);
+    outportb (VGA_CRTC_DATA, v);
+    g_vga_shadow.regs[VGA_CRTC_OFFSET + index] = v;
+}
+
+void vga_write_gc (int index, unsigned char v)
+{
+    if (g_vga_shadow_valid && g_vga_shadow.regs[VGA_GC_OFFSET + index] == v)
+        return;
+
+    outportb (VGA_GC_INDEX, index);
+    outportb (VGA_GC_DATA, v);
+    g_vga_shadow.regs[VGA_GC_OFFSET + index] = v;
+}
+
+/* loads count colors from first, setting the write index once per run
+ * of changed colors and letting the dac step through the rest */
+void vga_set_dac (int first, int count, unsigned char * rgb)
+{
+    int next = -1;
+
+    if (first < 0 || count < 0 || first + count > 256)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned char * shadow = &g_vga_shadow.dac[(first + i) * 3];
+        unsigned char * c = &rgb[i * 3];
+
+        if (g_vga_shadow_valid && shadow[0] == c[0] && shadow[1] == c[1] && shadow[2] == c[2])
+            continue;
+
+        if (next != first + i)
+            outportb (VGA_DAC_WRITE_INDEX, first + i);
+        outportb (VGA_DAC_DATA, c[0]);
+        outportb (VGA_DAC_DATA, c[1]);
+        outportb (VGA_DAC_DATA, c[2]);
+        shadow[0] = c[0];
+        shadow[1] = c[1];
+        shadow[2] = c[2];
+        next = first + i + 1;
+    }
+}
+
+/* reads every register back from the card, only done once at start up */
+void vga_read_state (VGA_STATE * state)
+{
+    unsigned int i;
+
+    state->regs[0] = inportb (VGA_MISC_READ);
+
+    for (i = 0; i < VGA_NUM_SEQ_REGS; i++)
+    {
+        outportb (VGA_SEQ_INDEX, i);
+        state->regs[VGA_SEQ_OFFSET + i] = inportb (VGA_SEQ_DATA);
+    }
+
+    for (i = 0; i < VGA_NUM_CRTC_REGS; i++)
+    {
+        outportb (VGA_CRTC_INDEX, i);
+        state->regs[VGA_CRTC_OFFSET + i] = inportb (VGA_CRTC_DATA);
+    }
+
+    for (i = 0; i < VGA_NUM_GC_REGS; i++)
+    {
+        outportb (VGA_GC_INDEX, i);
+        state->regs[VGA_GC_OFFSET + i] = inportb (VGA_GC_DATA);
+    }
+
+    for (i = 0; i < VGA_NUM_AC_REGS; i++)
+    {
+        (void) inportb (VGA_INSTAT_READ);
+        outportb (VGA_AC_INDEX, i);
+        state->regs[VGA_AC_OFFSET + i] = inportb (VGA_AC_READ);
+    }
+    (void) inportb (VGA_INSTAT_READ);
+    outportb (VGA_AC_INDEX, 0x20);
+
+    outportb (VGA_DAC_READ_INDEX, 0);
+    for (i = 0; i < VGA_DAC_SIZE; i++)
+        state->dac[i] = inportb (VGA_DAC_DATA);
+}
+
+void vga_save_state (VGA_STATE * state)
+{
+    *state = g_vga_shadow;
+}
+
+void vga_restore_state (VGA_STATE * state)
+{
+    write_regs(state->regs);
+    vga_set_dac(0, 256, state->dac);
+}
+
+/* copies the 8x8 font into plane 2, where text mode fetches glyphs,
+ * one 32 byte slot per character */
+void load_text_font ()
+{
+    unsigned char seq2 = g_vga_shadow.regs[VGA_SEQ_OFFSET + 2];
+    unsigned char seq4 = g_vga_shadow.regs[VGA_SEQ_OFFSET + 4];
+    unsigned char gc4 = g_vga_shadow.regs[VGA_GC_OFFSET + 4];
+    unsigned char gc5 = g_vga_shadow.regs[VGA_GC_OFFSET + 5];
+    unsigned char gc6 = g_vga_shadow.regs[VGA_GC_OFFSET + 6];
+
+    /* plane 2 only, flat addressing, mapped at 0xA0000 */
+    vga_write_seq(2, 0x04);
+    vga_write_seq(4, 0x06);
+    vga_write_gc(4, 0x02);
+    vga_write_gc(5, 0x00);
+    vga_write_gc(6, 0x04);
+
+    for (int c = 0; c < 256; c++)
+        for (int i = 0; i < 32; i++)
+            poke_b(VIDEO_BASE_ADDRESS + c * 32 + i,
+                i < FONT_SIZE ? g_8x8_font[c * FONT_SIZE + i] : 0);
+
+    vga_write_seq(2, seq2);
+    vga_write_seq(4, seq4);
+    vga_write_gc(4, gc4);
+    vga_write_gc(5, gc5);
+    vga_write_gc(6, gc6);
+}
+
+/**************************************************************
+ *                      API : SET MODE                        *
+ *************************************************************/
+
+/* swaps between the compositor and an 80x50 text console, e.g. for a
+ * crash screen. only registers that differ between the modes are
+ * written, and the graphics state comes back exactly as it was left */
+void set_mode(PARAM_VGA_SET_MODE * params)
+{
+    static unsigned char g_80x50_text[] =
+    {
+        /* MISC */
+        0x67,
+        /* SEQ */
+        0x03, 0x00, 0x03, 0x00, 0x02,
+        /* CRTC */
+        0x5F, 0x4F, 0x50, 0x82, 0x55, 0x81, 0xBF, 0x1F,
+        0x00, 0x47, 0x06, 0x07, 0x00, 0x00, 0x01, 0x40,
+        0x9C, 0x8E, 0x8F, 0x28, 0x1F, 0x96, 0xB9, 0xA3,
+        0xFF,
+        /* GC */
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0E, 0x00,
+        0xFF,
+        /* AC */
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07,
+        0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+        0x0C, 0x00, 0x0F, 0x08, 0x00
+    };
+
+    if(params->mode == g_vga_mode)
+        return;
+
+    if(params->mode == VGA_MODE_TEXT) {
+        /* the text planes overwrite the framebuffer, so sprites come
+         * down first and nothing is presented until graphics return */
+        sprites_hide();
+        g_sprites_suspended = 1;
+        vga_save_state(&g_vga_saved);
+        g_vga_mode = VGA_MODE_TEXT;
+
+        write_regs(g_80x50_text);
+        vga_set_dac(0, 256, g_text_dac);
+        load_text_font();
+
+        for(int i = 0; i < TEXT_COLS * TEXT_ROWS; i++)
+            poke_w(TEXT_BASE_ADDRESS + i * 2, 0x0720);
+    }
+    else if(params->mode == VGA_MODE_13H) {
+        vga_restore_state(&g_vga_saved);
+        g_vga_mode = VGA_MODE_13H;
+        g_sprites_suspended = 0;
+
+        /* the planes no longer hold our pixels, composite all of them */
+        BOUND screen = screen_bound();
+        add_damage(&screen);
+        vga_present();
+        sprites_show();
+    }
+}
+
+/**************************************************************
+ *                     API : SET PALETTE                      *
+ *************************************************************/
+
+void set_palette(PARAM_VGA_SET_PALETTE * params)
+{
+    if(params->rgb == NULL || params->first < 0 || params->count < 0 ||
+        params->first + params->count > 256)
+        return;
+
+    /* text mode shows the bios colors, these wait for graphics to return */
+    if(g_vga_mode == VGA_MODE_TEXT) {
+        for(int i = 0; i < params->count * 3; i++)
+            g_vga_saved.dac[params->first * 3 + i] = params->rgb[i];
+        return;
+    }
+
+    vga_set_dac(params->first, params->count, params->rgb);
+}
+
+/**************************************************************
+ *                     API : TEXT WRITE                       *
+ *************************************************************/
+
+/* puts text on the text console from column x of row y, wrapping at the
+ * right edge and stopping at the bottom. ignored in graphics mode */
+void text_write(PARAM_VGA_TEXT_WRITE * params)
+{
+    if(g_vga_mode != VGA_MODE_TEXT || params->text == NULL)
+        return;
+    if(params->x < 0 || params->x >= TEXT_COLS || params->y < 0 || params->y >= TEXT_ROWS)
+        return;
+
+    int pos = params->y * TEXT_COLS + params->x;
+
+    for(char * c = params->text; *c != '\0' && pos < TEXT_COLS * TEXT_ROWS; c++) {
+        if(*c == '\n') {
+            pos = (pos / TEXT_COLS + 1) * TEXT_COLS;
+            continue;
+        }
+        poke_w(TEXT_BASE_ADDRESS + pos * 2, (params->attr << 8) | (unsigned char) *c);
+        pos++;
+    }
+}
+
+/**************************************************************
+ *                   API : CREATE WINDOW                      *
+ *************************************************************/
+
+void create_window ( PARAM_VGA_CREATE_WINDOW * params)
+{
+	VGA_WINDOW * window = malloc( sizeof(VGA_WINDOW) );
+	if(window == NULL || !alloc_window_slot(window)) {
+		free(window);
+		params->window_id = -1;
+		return;
+	}
+	window->frame.bound.x = params->x-1;
+	window->frame.bound.y = params->y-10;
+	window->frame.bound.width = params->width+2;
+	window->frame.bound.height = params->height+11;
+	window->canvas.bound.x = params->x;
+	window->canvas.bound.y = params->y;
+	window->canvas.bound.width = params->width;
+	window->canvas.bound.height = params->height;
+    if(!init_canvas(window, BLACK)) {
+        free_window_slot(window->slot);
+        free(window);
+        params->window_id = -1;
+        return;
+    }
+	window->id = g_window_id++;
+	params->window_id = window->id;
+    window->color = current_color++;
+    window->console = NULL;
+    window->visibility = VIS_FULL;
+    window->minimized = 0;
+    window->upload.active = 0;
+
+    int bound_size = 1;
+    while (bound_size < window->frame.bound.width ||
+        bound_size < window->frame.bound.height) 
+        {
+            bound_size *= 2;
+        }
+
+    /* only the quadtree backend reads the pointer tree */
+    window->root = NULL;
+    if(g_occlusion_backend == OCCLUSION_QUADTREE)
+        window->root = create_qnode(
+            window->frame.bound.x, 
+            window->frame.bound.y, 
+            bound_size, 
+            bound_size);
+
+    window->lq.nodes = NULL;
+    window->lq.count = 0;
+    window->lq.capacity = 0;
+    window->lq.size = bound_size;
+
+    window->next = NULL;
     window->prev = NULL;
 	add_window_to_list(window);
+
+    /* new windows go on top, so they own their whole frame */
+    owner_map_fill(&(window->frame.bound), window->slot);
+    build_quadtrees();
+    update_visibility(&(window->frame.bound));
+    add_damage(&(window->frame.bound));
+}
+
+/**************************************************************
+ *                    API : DRAW PIXEL                        *
+ *************************************************************/
+
+void draw_pixel (PARAM_VGA_DRAW_PIXEL * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+	set_canvas_pixel(wnd, params->x, params->y, params->color);
+
+    damage_canvas(wnd, params->x, params->y, 1, 1);
+}
+
+ /*************************************************************
+ *                      API : DRAW TEXT                       * 
+ *************************************************************/
+
+void draw_text (PARAM_VGA_DRAW_TEXT * params) 
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+	/* print string */
+	draw_string(wnd, params->x, params->y, params->bg_color, params->fg_color, params->text);
+
+    int len = 0;
+    while(params->text[len] != '\0')
+        len++;
+
+    damage_canvas(wnd, params->x, params->y, len * FONT_SIZE, FONT_SIZE);
+}
+
+ /*************************************************************
+ *                     API : DRAW LINE                        *
+ *************************************************************/
+
+void draw_line (PARAM_VGA_DRAW_LINE * params)
+{
+
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+	raster_line(wnd, params->x0, params->y0, params->x1, params->y1, params->color);
+
+    damage_canvas(wnd,
+        params->x0 < params->x1 ? params->x0 : params->x1,
+        params->y0 < params->y1 ? params->y0 : params->y1,
+        m_abs(params->x1 - params->x0) + 1, m_abs(params->y1 - params->y0) + 1);
+}
+
+ /*************************************************************
+ *                     API : CHANGE WINDOW                    *
+ *************************************************************/
+
+ void change_window(PARAM_VGA_CHANGE_FOCUS * params)
+ {
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    /* focusing a minimized window restores it */
+    wnd->minimized = 0;
+    bring_window_forward(params->window_id);
+    owner_map_fill(&(wnd->frame.bound), wnd->slot);
+    build_quadtrees();
+    update_visibility(&(wnd->frame.bound));
+    add_damage(&(wnd->frame.bound));
+ }
+
+ /*************************************************************
+ *                     API : MOVE WINDOW                      *
+ *************************************************************/
+
+void move_window(PARAM_VGA_MOVE_WINDOW * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    BOUND old = wnd->frame.bound;
+
+	wnd->frame.bound.x = params->x-1;
+	wnd->frame.bound.y = params->y-10;
+	wnd->canvas.bound.x = params->x;
+	wnd->canvas.bound.y = params->y;
+    if(wnd->root) {
+        wnd->root->bound.x = wnd->frame.bound.x;
+        wnd->root->bound.y = wnd->frame.bound.y;
+    }
+
+    /* the window keeps its place in the stack, so both the area it
+     * left and the area it now covers are repainted in z-order */
+    owner_map_repaint(&old);
+    owner_map_repaint(&(wnd->frame.bound));
+    build_quadtrees();
+    update_visibility(&old);
+    update_visibility(&(wnd->frame.bound));
+    add_damage(&old);
+    add_damage(&(wnd->frame.bound));
+}
+
+ /*************************************************************
+ *                    API : DESTROY WINDOW                    *
+ *************************************************************/
+
+void destroy_window(PARAM_VGA_DESTROY_WINDOW * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    remove_window_from_list(wnd);
+    owner_map_repaint(&(wnd->frame.bound));
+    free_window_slot(wnd->slot);
+
     build_quadtrees();
-    vga_render_windows();
+    update_visibility(&(wnd->frame.bound));
+    add_damage(&(wnd->frame.bound));
+
+    if(wnd->console)
+        destroy_console(wnd->console);
+    destroy_qnode(wnd->root);
+    lq_release(wnd);
+    destroy_canvas(wnd);
+    free(wnd);
+}
+
+ /*************************************************************
+ *                    API : MINIMIZE WINDOW                   *
+ *************************************************************/
+
+void minimize_window(PARAM_VGA_MINIMIZE * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    if(!params->minimize) {
+        PARAM_VGA_CHANGE_FOCUS focus;
+        focus.window_id = wnd->id;
+        change_window(&focus);
+        return;
+    }
+
+    if(wnd->minimized)
+        return;
+
+    /* the window keeps its canvas and place in the stack, it just
+     * stops owning pixels until it is restored */
+    wnd->minimized = 1;
+    owner_map_repaint(&(wnd->frame.bound));
+    build_quadtrees();
+    update_visibility(&(wnd->frame.bound));
+    add_damage(&(wnd->frame.bound));
+}
+
+ /*************************************************************
+ *                    API : DEFINE SPRITE                     *
+ *************************************************************/
+
+void define_sprite(PARAM_VGA_SPRITE_DEFINE * params)
+{
+    if(params->pixels == NULL)
+        return;
+    if(params->sprite_id < 0 || params->sprite_id >= MAX_SPRITES)
+        return;
+    if(params->width < 1 || params->width > MAX_SPRITE_SIZE)
+        return;
+    if(params->height < 1 || params->height > MAX_SPRITE_SIZE)
+        return;
+
+    SPRITE * sp = &sprites[params->sprite_id];
+
+    sprites_hide();
+    sp->defined = 1;
+    sp->bound.width = params->width;
+    sp->bound.height = params->height;
+    sp->color_key = params->color_key;
+    for(int i = 0; i < params->width * params->height; i++)
+        sp->pixels[i] = params->pixels[i];
+    sprites_show();
+}
+
+ /*************************************************************
+ *                     API : MOVE SPRITE                      *
+ *************************************************************/
+
+void move_sprite(PARAM_VGA_SPRITE_MOVE * params)
+{
+    if(params->sprite_id < 0 || params->sprite_id >= MAX_SPRITES)
+        return;
+
+    SPRITE * sp = &sprites[params->sprite_id];
+    if(!sp->defined)
+        return;
+
+    /* put back what the sprites covered and draw them again, windows
+     * are never touched */
+    sprites_hide();
+    sp->bound.x = params->x;
+    sp->bound.y = params->y;
+    sp->visible = params->visible;
+    sprites_show();
+}
+
+ /*************************************************************
+ *                     API : UPLOAD IMAGE                     *
+ *************************************************************/
+
+void upload_begin(PARAM_VGA_UPLOAD_BEGIN * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    if(params->width <= 0 || params->height <= 0)
+        return;
+
+    wnd->upload.active = 1;
+    wnd->upload.bound = create_bound(params->x, params->y, params->width, params->height);
+    wnd->upload.row = 0;
+    wnd->upload.col = 0;
+    wnd->upload.flushed = 0;
+}
+
+/* copies the next chunk of the image straight into the canvas rows,
+ * rows that are finished get composited right away */
+void upload_rows(PARAM_VGA_UPLOAD_ROWS * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL || !wnd->upload.active || params->pixels == NULL)
+		return;
+
+    UPLOAD * up = &(wnd->upload);
+    BOUND cb = wnd->canvas.bound;
+    unsigned char * src = params->pixels;
+    int count = params->count;
+
+    while(count > 0 && up->row < up->bound.height) {
+
+        int n = up->bound.width - up->col;
+        if(n > count)
+            n = count;
+
+        /* clip the piece of the row to the canvas */
+        int y = up->bound.y + up->row;
+        int x0 = up->bound.x + up->col;
+        int x1 = x0 + n;
+        int skip = x0 < 0 ? -x0 : 0;
+        if(x0 < 0)
+            x0 = 0;
+        if(x1 > cb.width)
+            x1 = cb.width;
+
+        int * row = NULL;
+        if(y >= 0 && y < cb.height && x0 < x1)
+            row = canvas_row(wnd, y);
+        if(row != NULL) {
+            for(int x = x0; x < x1; x++)
+                row[x] = src[skip + x - x0];
+        }
+
+        src += n;
+        count -= n;
+        up->col += n;
+        if(up->col == up->bound.width) {
+            up->col = 0;
+            up->row++;
+        }
+    }
+
+    if(up->row > up->flushed) {
+        damage_canvas(wnd, up->bound.x, up->bound.y + up->flushed,
+            up->bound.width, up->row - up->flushed);
+        up->flushed = up->row;
+    }
+}
+
+void upload_end(PARAM_VGA_UPLOAD_END * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL || !wnd->upload.active)
+		return;
+
+    UPLOAD * up = &(wnd->upload);
+
+    /* a short image still shows the row it stopped in */
+    if(up->col > 0)
+        damage_canvas(wnd, up->bound.x, up->bound.y + up->flushed,
+            up->bound.width, up->row - up->flushed + 1);
+
+    up->active = 0;
+}
+
+ /*************************************************************
+ *                     API : SET PRESENT                      *
+ *************************************************************/
+
+void set_present(PARAM_VGA_SET_PRESENT * params)
+{
+    g_present_mode = params->mode;
+    g_present_vsync = params->vsync;
+    if(params->interval > 0)
+        g_present_interval = params->interval;
+
+    /* nothing may stay behind when going back to immediate mode */
+    if(g_present_mode == PRESENT_IMMEDIATE)
+        vga_present();
+
+    /* deferred presents need the clock running again */
+    if(g_present_mode == PRESENT_DEFERRED && g_clock_parked) {
+        g_clock_parked = 0;
+        reply(g_clock_sender);
+    }
+}
+
+ /*************************************************************
+ *                    API : SET OCCLUSION                     *
+ *************************************************************/
+
+/* picks the backend set_pixel asks, the screen looks the same under
+ * each so nothing is redrawn. unknown backends are ignored */
+void set_occlusion(PARAM_VGA_SET_OCCLUSION * params)
+{
+    if(params->backend != OCCLUSION_QUADTREE &&
+        params->backend != OCCLUSION_OWNER_MAP &&
+        params->backend != OCCLUSION_LINEAR_QTREE)
+        return;
+
+    if(params->backend != g_occlusion_backend)
+        set_occlusion_backend(params->backend);
+}
+
+ /*************************************************************
+ *                    API : CREATE CONSOLE                    *
+ *************************************************************/
+
+void create_console(PARAM_VGA_CREATE_CONSOLE * params)
+{
+    params->window_id = -1;
+    if(params->cols < 1 || params->rows < 1)
+        return;
+
+    CONSOLE * con = malloc( sizeof(CONSOLE) );
+    if(con == NULL)
+        return;
+
+    con->cols = params->cols;
+    con->rows = params->rows;
+    con->cursor_x = 0;
+    con->cursor_y = 0;
+    con->cells = malloc( sizeof(CELL) * con->cols * con->rows );
+    con->dirty_lo = malloc( sizeof(int) * con->rows );
+    con->dirty_hi = malloc( sizeof(int) * con->rows );
+    if(con->cells == NULL || con->dirty_lo == NULL || con->dirty_hi == NULL) {
+        if(con->cells)
+            free(con->cells);
+        if(con->dirty_lo)
+            free(con->dirty_lo);
+        if(con->dirty_hi)
+            free(con->dirty_hi);
+        free(con);
+        return;
+    }
+
+    PARAM_VGA_CREATE_WINDOW create;
+    create.title = params->title;
+    create.x = params->x;
+    create.y = params->y;
+    create.width = params->cols * FONT_SIZE;
+    create.height = params->rows * FONT_SIZE;
+    create_window(&create);
+
+    params->window_id = create.window_id;
+    VGA_WINDOW * wnd = get_window(create.window_id);
+	if(wnd == NULL) {
+        destroy_console(con);
+		return;
+    }
+
+    wnd->console = con;
+
+    /* start out blank with every cell waiting to be drawn */
+    for(int row = 0; row < con->rows; row++) {
+        for(int col = 0; col < con->cols; col++) {
+            CELL * cell = con->cells + row * con->cols + col;
+            cell->c = ' ';
+            cell->fg = WHITE;
+            cell->bg = BLACK;
+            cell->dirty = 1;
+        }
+        con->dirty_lo[row] = 0;
+        con->dirty_hi[row] = con->cols - 1;
+    }
+    console_flush(wnd);
+}
+
+ /*************************************************************
+ *                    API : CONSOLE WRITE                     *
+ *************************************************************/
+
+void console_write(PARAM_VGA_CONSOLE_WRITE * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL || wnd->console == NULL)
+		return;
+
+    const char * str = params->text;
+    while(*str != '\0') {
+        console_put(wnd, *str, params->fg_color, params->bg_color);
+        str++;
+    }
+
+    console_flush(wnd);
+}
+
+ /*************************************************************
+ *                        API : SCROLL                        *
+ *************************************************************/
+
+void scroll_canvas(PARAM_VGA_SCROLL * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    BOUND r = create_bound(params->x, params->y, params->width, params->height);
+    scroll_region(wnd, r, params->dx, params->dy, params->color);
+}
+
+/* shifts the canvas area r by dx/dy and fills what is uncovered with
+ * color, moving the pixels on screen too when nothing overlaps them */
+void scroll_region(VGA_WINDOW * wnd, BOUND r, int dx, int dy, int color)
+{
+    BOUND cb = wnd->canvas.bound;
+    BOUND local = create_bound(0, 0, cb.width, cb.height);
+
+    if(!bound_intersects(&r, &local))
+        return;
+
+    r = get_intersection(&r, &local);
+
+    if(m_abs(dx) >= r.width || m_abs(dy) >= r.height) {
+        canvas_fill_rect(wnd, &r, color);
+        damage_canvas(wnd, r.x, r.y, r.width, r.height);
+        return;
+    }
+
+    BOUND src = create_bound(
+        r.x + (dx < 0 ? -dx : 0),
+        r.y + (dy < 0 ? -dy : 0),
+        r.width - m_abs(dx),
+        r.height - m_abs(dy));
+
+    /* exposed rows across the full width and exposed columns */
+    BOUND rows = create_bound(r.x, dy > 0 ? r.y : r.y + r.height + dy, r.width, m_abs(dy));
+    BOUND cols = create_bound(dx > 0 ? r.x : r.x + r.width + dx, r.y, m_abs(dx), r.height);
+
+    canvas_move_rect(wnd, &src, src.x + dx, src.y + dy);
+    canvas_fill_rect(wnd, &rows, color);
+    canvas_fill_rect(wnd, &cols, color);
+
+    BOUND screen_r = create_bound(cb.x + r.x, cb.y + r.y, r.width, r.height);
+
+    if(bound_owned_by(wnd, &screen_r) && !damage_intersects(&screen_r)) {
+        BOUND screen_src = create_bound(cb.x + src.x, cb.y + src.y, src.width, src.height);
+        screen_move_rect(&screen_src, dx, dy);
+        damage_canvas(wnd, rows.x, rows.y, rows.width, rows.height);
+        damage_canvas(wnd, cols.x, cols.y, cols.width, cols.height);
+    } else {
+        damage_canvas(wnd, r.x, r.y, r.width, r.height);
+    }
+}
+
+ /*************************************************************
+ *                     API : CLEAR CANVAS                     *
+ *************************************************************/
+
+void clear_canvas(PARAM_VGA_CLEAR_CANVAS * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL)
+		return;
+
+    /* a full fill releases every band back to a solid color */
+    BOUND all = create_bound(0, 0, wnd->canvas.bound.width, wnd->canvas.bound.height);
+    canvas_fill_rect(wnd, &all, params->color);
+    damage_canvas(wnd, 0, 0, all.width, all.height);
+}
+
+ /*************************************************************
+ *                        API : SHAPES                        *
+ *************************************************************/
+
+void draw_polygon(PARAM_VGA_DRAW_POLYGON * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL || params->points == NULL || params->count < 2)
+		return;
+
+    VGA_POINT * p = params->points;
+    int n = params->count;
+
+    if(params->mode == POLY_OUTLINE) {
+        for(int i = 0; i < n; i++) {
+            VGA_POINT * b = &p[(i + 1) % n];
+            raster_line(wnd, p[i].x, p[i].y, b->x, b->y, params->color);
+        }
+    } else {
+        fill_polygon(wnd, p, n, params->color, params->mode == POLY_NONZERO);
+    }
+
+    /* the whole shape reaches the screen as one rectangle */
+    int x0 = p[0].x, y0 = p[0].y, x1 = p[0].x, y1 = p[0].y;
+    for(int i = 1; i < n; i++) {
+        if(p[i].x < x0) x0 = p[i].x;
+        if(p[i].x > x1) x1 = p[i].x;
+        if(p[i].y < y0) y0 = p[i].y;
+        if(p[i].y > y1) y1 = p[i].y;
+    }
+    damage_canvas(wnd, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+void draw_ellipse(PARAM_VGA_DRAW_ELLIPSE * params)
+{
+    VGA_WINDOW * wnd = get_window(params->window_id);
+	if(wnd == NULL || params->rx < 0 || params->ry < 0)
+		return;
+
+    raster_ellipse(wnd, params->cx, params->cy, params->rx, params->ry,
+        params->color, params->filled);
+
+    damage_canvas(wnd, params->cx - params->rx, params->cy - params->ry,
+        2 * params->rx + 1, 2 * params->ry + 1);
+}
+
+ /*************************************************************
+ *                      API : BENCHMARK                       *
+ *************************************************************/
+
+void run_benchmark(PARAM_VGA_BENCHMARK * params)
+{
+    static const int sizes[][2] = { {320, 200}, {640, 480}, {1024, 768} };
+    static const int counts[] = { 4, 16, 64 };
+
+    BENCH_STATE saved;
+    unsigned seed = 1;
+    unsigned long long t;
+
+    bench_enter(&saved);
+    params->count = 0;
+
+    for(int s = 0; s < 3; s++) {
+
+        int w = sizes[s][0];
+        int h = sizes[s][1];
+        unsigned char * mem = malloc(w * h);
+        FRAMEBUFFER fb = { w, h, w, 1, (MEM_ADDR) mem };
+
+        if(mem == NULL)
+            continue;
+
+        window_list_head = NULL;
+        window_list_tail = NULL;
+        if(!set_framebuffer(&fb)) {
+            free(mem);
+            continue;
+        }
+
+        BOUND screen = screen_bound();
+        int windows = 0;
+
+        for(int c = 0; c < 3 && params->count < params->max_results; c++) {
+
+            /* grow the stack to the next count with random quarter-screen windows */
+            BOUND area = create_bound(1, 10, w - w / 4 - 2, h - h / 4 - 11);
+            while(windows < counts[c]) {
+                /* out of window slots, measure what we have */
+                if(bench_add_window(&seed, w / 4, h / 4, &area) == NULL)
+                    break;
+                windows++;
+            }
+
+            BENCH_RESULT * r = &(params->results[params->count++]);
+            r->width = w;
+            r->height = h;
+            r->windows = windows;
+
+            t = read_tsc();
+            clear_screen();
+            r->cycles[BENCH_CLEAR] = read_tsc() - t;
+
+            t = read_tsc();
+            owner_map_repaint(&screen);
+            r->cycles[BENCH_OWNER_MAP] = read_tsc() - t;
+
+            set_occlusion_backend(OCCLUSION_QUADTREE);
+            t = read_tsc();
+            build_quadtrees();
+            r->cycles[BENCH_QTREE_BUILD] = read_tsc() - t;
+
+            t = read_tsc();
+            vga_compose_rect(&screen);
+            r->cycles[BENCH_COMPOSE_QTREE] = read_tsc() - t;
+
+            set_occlusion_backend(OCCLUSION_OWNER_MAP);
+            t = read_tsc();
+            vga_compose_rect(&screen);
+            r->cycles[BENCH_COMPOSE_MAP] = read_tsc() - t;
+        }
+
+        bench_clear_stack();
+        free(mem);
+    }
+
+    bench_leave(&saved);
+}
+
+/* stacks sixth-screen windows around the middle of a 640x480 memory screen so
+ * nearly every frame is cut up by the ones in front of it, then times
+ * both trees building and answering a lookup for every frame pixel */
+void run_qtree_benchmark(PARAM_VGA_QTREE_BENCHMARK * params)
+{
+    static const int counts[] = { 8, 32, 64 };
+    int w = 640, h = 480;
+
+    BENCH_STATE saved;
+    unsigned seed = 1;
+    unsigned long long t;
+    int hidden = 0;
+
+    bench_enter(&saved);
+    params->count = 0;
+
+    unsigned char * mem = malloc(w * h);
+    FRAMEBUFFER fb = { w, h, w, 1, (MEM_ADDR) mem };
+
+    window_list_head = NULL;
+    window_list_tail = NULL;
+    if(mem == NULL || !set_framebuffer(&fb)) {
+        if(mem)
+            free(mem);
+        bench_leave(&saved);
+        return;
+    }
+
+    int windows = 0;
+
+    for(int c = 0; c < 3 && params->count < params->max_results; c++) {
+
+        BOUND area = create_bound(w / 2 - w / 6, h / 2 - h / 6, w / 6, h / 6);
+        while(windows < counts[c]) {
+            if(bench_add_window(&seed, w / 6, h / 6, &area) == NULL)
+                break;
+            windows++;
+        }
+
+        QTREE_BENCH_RESULT * r = &(params->results[params->count++]);
+        r->windows = windows;
+        r->lookups = 0;
+
+        set_occlusion_backend(OCCLUSION_QUADTREE);
+        t = read_tsc();
+        build_quadtrees();
+        r->build_cycles[BENCH_QT_POINTER] = read_tsc() - t;
+
+        /* the pointer tree no longer fits, larger tiers would not either */
+        if(g_qtree_failed) {
+            params->count--;
+            break;
+        }
+
+        t = read_tsc();
+        build_lqtrees();
+        r->build_cycles[BENCH_QT_LINEAR] = read_tsc() - t;
+
+        r->nodes[BENCH_QT_POINTER] = 0;
+        r->nodes[BENCH_QT_LINEAR] = 0;
+        for(VGA_WINDOW * wnd = window_list_head; wnd != NULL; wnd = wnd->next) {
+            r->nodes[BENCH_QT_POINTER] += count_qnodes(wnd->root);
+            r->nodes[BENCH_QT_LINEAR] += wnd->lq.count;
+        }
+        r->bytes[BENCH_QT_POINTER] = r->nodes[BENCH_QT_POINTER] * sizeof(QNODE);
+        r->bytes[BENCH_QT_LINEAR] = r->nodes[BENCH_QT_LINEAR] * sizeof(int);
+
+        t = read_tsc();
+        for(VGA_WINDOW * wnd = window_list_head; wnd != NULL; wnd = wnd->next) {
+            BOUND b = wnd->frame.bound;
+            for(int y = b.y; y < b.y + b.height; y++)
+                for(int x = b.x; x < b.x + b.width; x++)
+                    hidden += search_qtree(wnd->root, x, y);
+            r->lookups += b.width * b.height;
+        }
+        r->lookup_cycles[BENCH_QT_POINTER] = read_tsc() - t;
+
+        t = read_tsc();
+        for(VGA_WINDOW * wnd = window_list_head; wnd != NULL; wnd = wnd->next) {
+            BOUND b = wnd->frame.bound;
+            for(int y = b.y; y < b.y + b.height; y++)
+                for(int x = b.x; x < b.x + b.width; x++)
+                    hidden -= search_lqtree(wnd, x, y);
+        }
+        r->lookup_cycles[BENCH_QT_LINEAR] = read_tsc() - t;
+    }
+
+    /* both trees agree, so hidden is back to zero; kept so the
+     * lookups cannot be dropped */
+    g_bench_sink = hidden;
+
+    set_occlusion_backend(OCCLUSION_OWNER_MAP);
+    bench_clear_stack();
+    free(mem);
+    bench_leave(&saved);
+}
+
+/* parks the real stack and present settings so a benchmark can run on
+ * an empty stack drawing into memory, never the screen */
+void bench_enter(BENCH_STATE * saved)
+{
+    saved->fb = g_fb;
+    saved->head = window_list_head;
+    saved->tail = window_list_tail;
+    saved->backend = g_occlusion_backend;
+    saved->mode = g_present_mode;
+    saved->sprites_suspended = g_sprites_suspended;
+
+    sprites_hide();
+    g_sprites_suspended = 1;
+    g_present_mode = PRESENT_DEFERRED;
+}
+
+/* puts the real stack back on the real screen */
+void bench_leave(BENCH_STATE * saved)
+{
+    window_list_head = saved->head;
+    window_list_tail = saved->tail;
+    damage_count = 0;
+    set_occlusion_backend(saved->backend);
+    g_present_mode = saved->mode;
+    g_sprites_suspended = saved->sprites_suspended;
+    set_framebuffer(&(saved->fb));
+}
+
+/* creates a patterned width x height window whose canvas corner lands
+ * at a pseudo random point of area, stepping seed along */
+VGA_WINDOW * bench_add_window(unsigned * seed, int width, int height, BOUND * area)
+{
+    PARAM_VGA_CREATE_WINDOW create;
+    create.title = "bench";
+    create.width = width;
+    create.height = height;
+    *seed = *seed * 1103515245 + 12345;
+    create.x = area->x + (*seed >> 8) % area->width;
+    *seed = *seed * 1103515245 + 12345;
+    create.y = area->y + (*seed >> 8) % area->height;
+    create_window(&create);
+
+    VGA_WINDOW * wnd = get_window(create.window_id);
+    if(wnd == NULL)
+        return NULL;
+
+    for(int y = 0; y < height; y++)
+        for(int x = 0; x < width; x++)
+            set_canvas_pixel(wnd, x, y, (x ^ y) & 0x3F);
+    return wnd;
+}
+
+void bench_clear_stack()
+{
+    while(window_list_head != NULL) {
+        PARAM_VGA_DESTROY_WINDOW destroy;
+        destroy.window_id = window_list_head->id;
+        destroy_window(&destroy);
+    }
+}
+
+/**************************************************************
+ *                 PIXEL DRAWING UTILITIES                    *
+ *************************************************************/
+
+void clear_screen()
+{
+	for(int y = 0; y < g_fb.height; y++)
+		fill_span(0, y, g_fb.width, BLACK);
+}
+
+void set_pixel (VGA_WINDOW * window, int x, int y, int color)
+{
+	// check clip boundary
+	if(!bound_contains(&g_clip, x, y))
+		return;
+
+	// check owner map
+	if(g_occlusion_backend == OCCLUSION_OWNER_MAP) {
+		if(owner_map[y * g_fb.width + x] == window->slot)
+			poke_pixel(x, y, color);
+		return;
+	}
+
+	// check linear quadtree
+	if(g_occlusion_backend == OCCLUSION_LINEAR_QTREE) {
+		if(search_lqtree(window, x, y) == 0)
+			poke_pixel(x, y, color);
+		return;
+	}
+
+	// check quadtree
+	if(search_qtree(window->root, x, y) == 0)
+		poke_pixel(x, y, color);
+}
+
+/* screen writes under a sprite land in its save-under instead */
+void poke_pixel (int x, int y, int color)
+{
+	if(g_sprites_shown && bound_contains(&g_sprite_bound, x, y) &&
+		sprite_capture(x, y, color))
+		return;
+
+	poke_raw(x, y, color);
+}
+
+void poke_raw (int x, int y, int color)
+{
+	MEM_ADDR addr = g_fb.base + y * g_fb.stride + x * g_fb.bpp;
+
+	switch(g_fb.bpp) {
+		case 1: poke_b(addr, color); break;
+		case 2: poke_w(addr, color); break;
+		case 4: poke_l(addr, color); break;
+	}
+}
+
+int peek_raw (int x, int y)
+{
+	MEM_ADDR addr = g_fb.base + y * g_fb.stride + x * g_fb.bpp;
+
+	switch(g_fb.bpp) {
+		case 2: return peek_w(addr);
+		case 4: return peek_l(addr);
+	}
+	return peek_b(addr);
+}
+
+/* writes n canvas pixels to the screen, 8 at a time when aligned */
+void poke_canvas_span (int x, int y, int * src, int n)
+{
+	MEM_ADDR addr = g_fb.base + y * g_fb.stride + x;
+
+	if(g_fb.bpp != 1 || sprites_cover_span(x, y, n)) {
+		while(n-- > 0)
+			poke_pixel(x++, y, *(src++));
+		return;
+	}
+
+	while(n > 0 && (addr & 3)) {
+		poke_b(addr++, *(src++));
+		n--;
+	}
+
+	while(n >= 8) {
+		poke_l(addr, (src[0] & 0xFF) | (src[1] & 0xFF) << 8 |
+			(src[2] & 0xFF) << 16 | (unsigned) (src[3] & 0xFF) << 24);
+		poke_l(addr+4, (src[4] & 0xFF) | (src[5] & 0xFF) << 8 |
+			(src[6] & 0xFF) << 16 | (unsigned) (src[7] & 0xFF) << 24);
+		addr += 8;
+		src += 8;
+		n -= 8;
+	}
+
+	while(n > 0) {
+		poke_b(addr++, *(src++));
+		n--;
+	}
+}
+
+/* fills n screen pixels with one color, 4 at a time when aligned */
+void fill_span (int x, int y, int n, int color)
+{
+	MEM_ADDR addr = g_fb.base + y * g_fb.stride + x;
+	unsigned quad = (color & 0xFF) * 0x01010101u;
+
+	if(g_fb.bpp != 1 || sprites_cover_span(x, y, n)) {
+		while(n-- > 0)
+			poke_pixel(x++, y, color);
+		return;
+	}
+
+	while(n > 0 && (addr & 3)) {
+		poke_b(addr++, color);
+		n--;
+	}
+
+	while(n >= 4) {
+		poke_l(addr, quad);
+		addr += 4;
+		n -= 4;
+	}
+
+	while(n > 0) {
+		poke_b(addr++, color);
+		n--;
+	}
+}
+
+/* copies n framebuffer bytes, overlap is fine */
+void fb_move (MEM_ADDR dst, MEM_ADDR src, int n)
+{
+	if(dst < src) {
+		for(int i = 0; i < n; i++)
+			poke_b(dst + i, peek_b(src + i));
+	} else if(dst > src) {
+		for(int i = n - 1; i >= 0; i--)
+			poke_b(dst + i, peek_b(src + i));
+	}
+}
+
+/* moves a screen rectangle by dx/dy, rows ordered so none is
+ * overwritten before it has been copied */
+void screen_move_rect (BOUND * src, int dx, int dy)
+{
+	int bytes = src->width * g_fb.bpp;
+	BOUND dst = create_bound(src->x + dx, src->y + dy, src->width, src->height);
+	BOUND area = get_union(src, &dst);
+
+	/* the copy must not carry sprite pixels along */
+	int lift = g_sprites_shown && bound_intersects(&area, &g_sprite_bound);
+	if(lift)
+		sprites_hide();
+
+	for(int i = 0; i < src->height; i++) {
+		int y = dy > 0 ? src->y + src->height - 1 - i : src->y + i;
+		MEM_ADDR from = g_fb.base + y * g_fb.stride + src->x * g_fb.bpp;
+		MEM_ADDR to = g_fb.base + (y + dy) * g_fb.stride + (src->x + dx) * g_fb.bpp;
+		fb_move(to, from, bytes);
+	}
+
+	if(lift)
+		sprites_show();
+}
+
+/* bresenham line into the canvas, clipped per pixel */
+void raster_line (VGA_WINDOW * wnd, int x0, int y0, int x1, int y1, int color)
+{
+	int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
+
+	dx = x1 - x0;
+	dy = y1 - y0;
+
+	dx1 = m_abs(dx);
+	dy1 = m_abs(dy);
+
+	px = 2 * dy1 - dx1;
+	py = 2 * dx1 - dy1;
+
+	if (dy1 <= dx1) {
+
+		if (dx >= 0) {
+			x = x0;
+			y = y0;
+			xe = x1;
+		} else {
+			x = x1;
+			y = y1;
+			xe = x0;
+		}
+
+		set_canvas_pixel(wnd, x, y, color);
+
+		for (i = 0; x < xe; i++) {
+			x += 1;
+
+			if (px < 0) {
+				px = px + 2 * dy1;
+			} else {
+				if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) {
+					y += 1;
+				} else {
+					y -= 1;
+				}
+				px = px + 2 * (dy1 - dx1);
+			}
+
+			set_canvas_pixel(wnd, x, y, color);
+		}
+
+	} else {
+
+		if (dy >= 0) {
+			x = x0;
+			y = y0;
+			ye = y1;
+		} else {
+			x = x1;
+			y = y1;
+			ye = y0;
+		}
+
+		set_canvas_pixel(wnd, x, y, color);
+
+		for (i = 0; y < ye; i++) {
+			y += 1;
+
+			if (py < 0) {
+				py = py + 2 * dx1;
+			} else {
+				if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) {
+					x += 1;
+				} else {
+					x -= 1;
+				}
+				py = py + 2 * (dx1 - dy1);
+			}
+
+            set_canvas_pixel(wnd, x, y, color);
+			
+		}
+
+	}
+}
+
+/* fills [x0, x1) of canvas row y through the rectangle fill */
+void canvas_span (VGA_WINDOW * wnd, int x0, int x1, int y, int color)
+{
+    if(y < 0 || y >= wnd->canvas.bound.height)
+        return;
+    if(x0 < 0)
+        x0 = 0;
+    if(x1 > wnd->canvas.bound.width)
+        x1 = wnd->canvas.bound.width;
+    if(x0 >= x1)
+        return;
+
+    BOUND r = create_bound(x0, y, x1 - x0, 1);
+    canvas_fill_rect(wnd, &r, color);
+}
+
+/* sets e up at the first scanline below a->b, sampling each row at its
+ * pixel centre so shared edges of adjacent polygons never overlap */
+void edge_init (EDGE * e, VGA_POINT * a, VGA_POINT * b)
+{
+    e->dir = 1;
+    if(a->y > b->y) {
+        VGA_POINT * t = a;
+        a = b;
+        b = t;
+        e->dir = -1;
+    }
+
+    int dx = b->x - a->x;
+    e->y0 = a->y;
+    e->y1 = b->y;
+    e->den = 2 * (b->y - a->y);
+
+    /* crossing at the first centre is a->x + dx / den */
+    e->x = a->x + dx / e->den;
+    e->r = dx % e->den;
+    if(e->r < 0) {
+        e->r += e->den;
+        e->x--;
+    }
+
+    e->step_x = 2 * dx / e->den;
+    e->step_r = 2 * dx % e->den;
+    if(e->step_r < 0) {
+        e->step_r += e->den;
+        e->step_x--;
+    }
+}
+
+void edge_step (EDGE * e)
+{
+    e->x += e->step_x;
+    e->r += e->step_r;
+    if(e->r >= e->den) {
+        e->r -= e->den;
+        e->x++;
+    }
+}
+
+/* edge table and active edge list scan conversion, emitting one span per
+ * inside run of every canvas row the polygon covers */
+void fill_polygon (VGA_WINDOW * wnd, VGA_POINT * points, int count, int color, int nonzero)
+{
+    EDGE * edges = malloc(count * sizeof(EDGE));
+    EDGE ** active = malloc(count * sizeof(EDGE *));
+    if(edges == NULL || active == NULL) {
+        if(edges) free(edges);
+        if(active) free(active);
+        return;
+    }
+
+    /* edge table sorted by first scanline, flat edges cross no centre */
+    int n = 0;
+    for(int i = 0; i < count; i++) {
+        VGA_POINT * a = &points[i];
+        VGA_POINT * b = &points[(i + 1) % count];
+        if(a->y == b->y)
+            continue;
+
+        EDGE e;
+        edge_init(&e, a, b);
+
+        int j = n++;
+        for(; j > 0 && edges[j-1].y0 > e.y0; j--)
+            edges[j] = edges[j-1];
+        edges[j] = e;
+    }
+
+    int y_end = 0;
+    for(int i = 0; i < n; i++)
+        if(edges[i].y1 > y_end)
+            y_end = edges[i].y1;
+    if(y_end > wnd->canvas.bound.height)
+        y_end = wnd->canvas.bound.height;
+
+    int y = n > 0 && edges[0].y0 > 0 ? edges[0].y0 : 0;
+    int next = 0, na = 0;
+
+    for(; y < y_end; y++) {
+
+        /* edges starting above the canvas are walked down to it */
+        while(next < n && edges[next].y0 <= y) {
+            EDGE * e = &edges[next++];
+            if(e->y1 <= y)
+                continue;
+            for(int k = e->y0; k < y; k++)
+                edge_step(e);
+            active[na++] = e;
+        }
+
+        int kept = 0;
+        for(int i = 0; i < na; i++)
+            if(active[i]->y1 > y)
+                active[kept++] = active[i];
+        na = kept;
+
+        if(na == 0) {
+            if(next == n)
+                break;
+            y = edges[next].y0 - 1;
+            continue;
+        }
+
+        /* first pixel whose centre is right of the crossing, the list
+         * barely changes order between rows so insertion sort it */
+        for(int i = 0; i < na; i++) {
+            EDGE * e = active[i];
+            e->key = e->x + (e->r > e->den / 2);
+
+            int j = i;
+            for(; j > 0 && active[j-1]->key > e->key; j--)
+                active[j] = active[j-1];
+            active[j] = e;
+        }
+
+        int wind = 0, start = 0;
+        for(int i = 0; i < na; i++) {
+            int was = wind;
+            wind = nonzero ? wind + active[i]->dir : !wind;
+
+            if(was == 0 && wind != 0)
+                start = active[i]->key;
+            else if(was != 0 && wind == 0)
+                canvas_span(wnd, start, active[i]->key, y, color);
+        }
+
+        for(int i = 0; i < na; i++)
+            edge_step(active[i]);
+    }
+
+    free(edges);
+    free(active);
+}
+
+/* midpoint ellipse, in quarter pixel units so it stays integral.
+ * filled ellipses keep the widest x of each row and fill it as a span */
+void raster_ellipse (VGA_WINDOW * wnd, int cx, int cy, int rx, int ry, int color, int filled)
+{
+    if(ry == 0) {
+        canvas_span(wnd, cx - rx, cx + rx + 1, cy, color);
+        return;
+    }
+
+    int * half = NULL;
+    if(filled) {
+        half = malloc((ry + 1) * sizeof(int));
+        if(half == NULL)
+            return;
+    }
+
+    long long rx2 = (long long) rx * rx;
+    long long ry2 = (long long) ry * ry;
+    long long px = 0;
+    long long py = 2 * rx2 * ry;
+    long long p = 4 * ry2 - 4 * rx2 * ry + rx2;
+    int x = 0, y = ry;
+
+    while(px < py) {
+        if(filled) {
+            half[y] = x;
+        } else {
+            set_canvas_pixel(wnd, cx + x, cy + y, color);
+            set_canvas_pixel(wnd, cx - x, cy + y, color);
+            set_canvas_pixel(wnd, cx + x, cy - y, color);
+            set_canvas_pixel(wnd, cx - x, cy - y, color);
+        }
+        x++;
+        px += 2 * ry2;
+        if(p < 0) {
+            p += 4 * (ry2 + px);
+        } else {
+            y--;
+            py -= 2 * rx2;
+            p += 4 * (ry2 + px - py);
+        }
+    }
+
+    p = ry2 * (2 * x + 1) * (2 * x + 1) + 4 * rx2 * (y - 1) * (y - 1) - 4 * rx2 * ry2;
+
+    while(y >= 0) {
+        if(filled) {
+            half[y] = x;
+        } else {
+            set_canvas_pixel(wnd, cx + x, cy + y, color);
+            set_canvas_pixel(wnd, cx - x, cy + y, color);
+            set_canvas_pixel(wnd, cx + x, cy - y, color);
+            set_canvas_pixel(wnd, cx - x, cy - y, color);
+        }
+        y--;
+        py -= 2 * rx2;
+        if(p > 0) {
+            p += 4 * (rx2 - py);
+        } else {
+            x++;
+            px += 2 * ry2;
+            p += 4 * (rx2 - py + px);
+        }
+    }
+
+    if(filled) {
+        for(int dy = 0; dy <= ry; dy++) {
+            canvas_span(wnd, cx - half[dy], cx + half[dy] + 1, cy - dy, color);
+            if(dy > 0)
+                canvas_span(wnd, cx - half[dy], cx + half[dy] + 1, cy + dy, color);
+        }
+        free(half);
+    }
+}
+
+int m_abs (int a) 
+{
+	return a < 0 ? -a : a;
+}
+
+void draw_string (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, const char * str) {
+
+	while (*(str) != '\0') {
+		draw_character(wnd, x, y, bg_color, fg_color, *(str));
+		str++;
+		x+=8;
+	}
+}
+
+void draw_character (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, char c) {
+
+	int i, n;
+	unsigned char b;
+
+	for (i = 0; i < FONT_SIZE; i++) {
+
+		b = g_8x8_font[(((int)c)*FONT_SIZE)+i];
+
+		for (n = 0; n < FONT_SIZE; n++) {
+
+			if ((b>>n&1)) {
+				set_canvas_pixel(wnd, x+FONT_SIZE-n-1, y+i, fg_color);
+			} else {
+				set_canvas_pixel(wnd, x+FONT_SIZE-n-1, y+i, bg_color);
+			}
+		}
+	}
+}
+
+
+/**************************************************************
+ *                   FRAMEBUFFER FUNCTIONS                    *
+ *************************************************************/
+
+/* points the compositor at a new framebuffer, resizing the owner map
+ * and tiles to match and redrawing everything into it */
+int set_framebuffer(FRAMEBUFFER * fb)
+{
+    /* sprites belong to the old framebuffer until it is switched */
+    sprites_hide();
+
+    int tiles_x = (fb->width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (fb->height + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned char * map = malloc(fb->width * fb->height);
+    unsigned char * tiles = malloc(tiles_x * tiles_y);
+
+    if(map == NULL || tiles == NULL) {
+        if(map)
+            free(map);
+        if(tiles)
+            free(tiles);
+        sprites_show();
+        return 0;
+    }
+
+    if(owner_map)
+        free(owner_map);
+    if(tile_owner)
+        free(tile_owner);
+
+    owner_map = map;
+    tile_owner = tiles;
+    g_tiles_x = tiles_x;
+    g_tiles_y = tiles_y;
+    g_fb = *fb;
+    g_clip = screen_bound();
+    damage_count = 0;
+
+    BOUND screen = screen_bound();
+    owner_map_repaint(&screen);
+    update_visibility(&screen);
+    add_damage(&screen);
+    sprites_show();
+    return 1;
+}
+
+BOUND screen_bound()
+{
+    return create_bound(0, 0, g_fb.width, g_fb.height);
+}
+
+/**************************************************************
+ *               WINDOW MANAGEMENT FUNCTIONS                  *
+ *************************************************************/
+
+VGA_WINDOW * get_window(int id)
+{
+    VGA_WINDOW * w_ptr = window_list_head;
+    while(w_ptr != NULL) {
+        if(w_ptr->id == id)
+            break;
+        w_ptr = w_ptr->next;
+    }
+    return w_ptr;
+}
+
+void vga_draw_frame(VGA_WINDOW * window)
+{
+	BOUND fb = window->frame.bound;
+
+	for(int x = fb.x; x < fb.x+fb.width; x++)
+		for(int y = fb.y; y < fb.y+10; y++)
+			set_pixel(window, x, y, WHITE);
+    
+    for(int y = fb.y; y < fb.y+fb.height; y++)
+        set_pixel(window, fb.x, y, WHITE);
+
+    for(int y = fb.y; y < fb.y+fb.height; y++)
+        set_pixel(window, fb.x+fb.width-1, y, WHITE);
+
+    for(int x = fb.x; x < fb.x+fb.width; x++)
+        set_pixel(window, x, fb.y+fb.height-1, WHITE);
+
+    draw_frame_title(window);
+}
+
+/* draws the part of the canvas that lies in r, r must be on screen */
+void vga_draw_canvas_rect(VGA_WINDOW * window, BOUND * r)
+{
+	BOUND cb = window->canvas.bound;
+
+	if(!bound_intersects(&cb, r))
+		return;
+
+	BOUND vb = get_intersection(&cb, r);
+
+	/* whole tiles owned by the window are copied row by row, tiles
+	 * owned by someone else are skipped, mixed ones go per pixel */
+	for(int ty = vb.y / TILE_SIZE; ty <= (vb.y+vb.height-1) / TILE_SIZE; ty++) {
+		for(int tx = vb.x / TILE_SIZE; tx <= (vb.x+vb.width-1) / TILE_SIZE; tx++) {
+
+			int owner = tile_owner[ty * g_tiles_x + tx];
+			if(owner != window->slot && owner != TILE_MIXED)
+				continue;
+
+			BOUND tb = create_bound(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+			BOUND sb = get_intersection(&tb, &vb);
+
+			for(int y = sb.y; y < sb.y+sb.height; y++) {
+				if(owner == window->slot && canvas_row_solid(window, y-cb.y)) {
+					fill_span(sb.x, y, sb.width,
+						window->canvas.band_color[(y-cb.y) / BAND_HEIGHT]);
+				} else if(owner == window->slot) {
+					poke_canvas_span(sb.x, y, canvas_row(window, y-cb.y) +
+						(sb.x-cb.x), sb.width);
+				} else {
+					for(int x = sb.x; x < sb.x+sb.width; x++)
+						set_pixel(window, x, y, get_canvas_pixel(window, x-cb.x, y-cb.y));
+				}
+			}
+		}
+	}
+}
+
+/* redraws desktop, frames and canvases inside r */
+void vga_compose_rect(BOUND * r)
+{
+	BOUND screen = screen_bound();
+
+	if(!bound_intersects(r, &screen))
+		return;
+
+	g_clip = get_intersection(r, &screen);
+
+	/* the trees answer per pixel, they get no help from the tiles */
+	if(g_occlusion_backend != OCCLUSION_OWNER_MAP) {
+		vga_compose_clip_per_pixel();
+		g_clip = screen;
+		return;
+	}
+
+	/* desktop shows through as runs of black */
+	for(int y = g_clip.y; y < g_clip.y+g_clip.height; y++) {
+		unsigned char * row = owner_map + y * g_fb.width;
+		int x = g_clip.x;
+		while(x < g_clip.x+g_clip.width) {
+			int start = x;
+			while(x < g_clip.x+g_clip.width && row[x] == DESKTOP_SLOT)
+				x++;
+			if(x > start)
+				fill_span(start, y, x-start, BLACK);
+			else
+				x++;
+		}
+	}
+
+	VGA_WINDOW * w_ptr = window_list_head;
+	while(w_ptr != NULL) {
+		if(w_ptr->visibility != VIS_HIDDEN &&
+			bound_intersects(&(w_ptr->frame.bound), &g_clip)) {
+			if(!bound_contains_within(&g_clip, &(w_ptr->canvas.bound)))
+				vga_draw_frame(w_ptr);
+			vga_draw_canvas_rect(w_ptr, &g_clip);
+		}
+		w_ptr = w_ptr->next;
+	}
+
+	g_clip = screen;
+}
+
+/* paints g_clip black and every window over it one set_pixel at a time,
+ * leaving all occlusion to the quadtree backends */
+void vga_compose_clip_per_pixel()
+{
+	for(int y = g_clip.y; y < g_clip.y+g_clip.height; y++)
+		fill_span(g_clip.x, y, g_clip.width, BLACK);
+
+	VGA_WINDOW * w_ptr = window_list_head;
+	while(w_ptr != NULL) {
+		if(w_ptr->visibility != VIS_HIDDEN &&
+			bound_intersects(&(w_ptr->frame.bound), &g_clip)) {
+			BOUND cb = w_ptr->canvas.bound;
+
+			vga_draw_frame(w_ptr);
+			if(bound_intersects(&cb, &g_clip)) {
+				BOUND vb = get_intersection(&cb, &g_clip);
+				for(int y = vb.y; y < vb.y+vb.height; y++)
+					for(int x = vb.x; x < vb.x+vb.width; x++)
+						set_pixel(w_ptr, x, y, get_canvas_pixel(w_ptr, x-cb.x, y-cb.y));
+			}
+		}
+		w_ptr = w_ptr->next;
+	}
+}
+
+/* used to add a new window to the global window list */
+void add_window_to_list(VGA_WINDOW * w)
+{
+    if(!window_list_head) {
+        window_list_head = w;
+        window_list_tail = w;
+    } else {
+        w->next = window_list_head;
+        window_list_head->prev = w;
+        window_list_head = w;
+    }
+}
+
+/* used to unlink a window from the global window list */
+void remove_window_from_list(VGA_WINDOW * w)
+{
+    if(w->prev)
+        w->prev->next = w->next;
+    else
+        window_list_head = w->next;
+
+    if(w->next)
+        w->next->prev = w->prev;
+    else
+        window_list_tail = w->prev;
+
+    w->next = NULL;
+    w->prev = NULL;
+}
+
+int get_canvas_pixel(VGA_WINDOW * wnd, int x, int y)
+{
+    int band = y / BAND_HEIGHT;
+
+    if(wnd->canvas.band_buffer[band] == NULL)
+        return wnd->canvas.band_color[band];
+    return *(wnd->canvas.band_buffer[band] +
+        (y % BAND_HEIGHT) * wnd->canvas.bound.width + x);
+}
+
+void set_canvas_pixel(VGA_WINDOW * wnd, int x, int y, int color)
+{
+    if(x < 0 || x > wnd->canvas.bound.width-1)
+        return;
+    if(y < 0 || y > wnd->canvas.bound.height-1)  
+        return;
+
+    /* painting a solid band its own color needs no storage */
+    int band = y / BAND_HEIGHT;
+    if(wnd->canvas.band_buffer[band] == NULL && wnd->canvas.band_color[band] == color)
+        return;
+
+    int * row = canvas_row(wnd, y);
+    if(row != NULL)
+        row[x] = color;
+}
+
+/* sets up a canvas of solid color without any pixel storage,
+ * returns 0 when the band arrays cannot be allocated */
+int init_canvas(VGA_WINDOW * wnd, int color)
+{
+    CANVAS * c = &(wnd->canvas);
+
+    c->bands = (c->bound.height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+    c->band_color = malloc( sizeof(int) * c->bands );
+    c->band_buffer = malloc( sizeof(int *) * c->bands );
+    if(c->band_color == NULL || c->band_buffer == NULL) {
+        free(c->band_color);
+        free(c->band_buffer);
+        return 0;
+    }
+
+    for(int band = 0; band < c->bands; band++) {
+        c->band_color[band] = color;
+        c->band_buffer[band] = NULL;
+    }
+    return 1;
+}
+
+void destroy_canvas(VGA_WINDOW * wnd)
+{
+    CANVAS * c = &(wnd->canvas);
+
+    for(int band = 0; band < c->bands; band++)
+        if(c->band_buffer[band])
+            free(c->band_buffer[band]);
+
+    free(c->band_buffer);
+    free(c->band_color);
+}
+
+/* returns row y for writing, giving its band storage if it is solid.
+ * NULL when that storage cannot be had, the band then stays solid and
+ * the caller drops its write */
+int * canvas_row(VGA_WINDOW * wnd, int y)
+{
+    CANVAS * c = &(wnd->canvas);
+    int band = y / BAND_HEIGHT;
+
+    if(c->band_buffer[band] == NULL) {
+        int n = c->bound.width * BAND_HEIGHT;
+        int * buffer = malloc( sizeof(int) * n );
+        if(buffer == NULL)
+            return NULL;
+        for(int i = 0; i < n; i++)
+            buffer[i] = c->band_color[band];
+        c->band_buffer[band] = buffer;
+    }
+
+    return c->band_buffer[band] + (y % BAND_HEIGHT) * c->bound.width;
+}
+
+int canvas_row_solid(VGA_WINDOW * wnd, int y)
+{
+    return wnd->canvas.band_buffer[y / BAND_HEIGHT] == NULL;
+}
+
+/* copies n pixels of one canvas row to another, overlap is fine */
+void canvas_copy_row(VGA_WINDOW * wnd, int dst_x, int dst_y, int src_x, int src_y, int n)
+{
+    int src_band = src_y / BAND_HEIGHT;
+    int dst_band = dst_y / BAND_HEIGHT;
+
+    if(canvas_row_solid(wnd, src_y)) {
+        int color = wnd->canvas.band_color[src_band];
+        if(canvas_row_solid(wnd, dst_y) && wnd->canvas.band_color[dst_band] == color)
+            return;
+        int * dst = canvas_row(wnd, dst_y);
+        if(dst == NULL)
+            return;
+        for(int i = 0; i < n; i++)
+            dst[dst_x + i] = color;
+        return;
+    }
+
+    int * dst = canvas_row(wnd, dst_y);
+    if(dst != NULL)
+        move_ints(dst + dst_x, canvas_row(wnd, src_y) + src_x, n);
+}
+
+/* reverses the order of bands first..last */
+void canvas_reverse_bands(VGA_WINDOW * wnd, int first, int last)
+{
+    CANVAS * c = &(wnd->canvas);
+
+    while(first < last) {
+        int color = c->band_color[first];
+        int * buffer = c->band_buffer[first];
+        c->band_color[first] = c->band_color[last];
+        c->band_buffer[first] = c->band_buffer[last];
+        c->band_color[last] = color;
+        c->band_buffer[last] = buffer;
+        first++;
+        last--;
+    }
+}
+
+/* moves count canvas rows from src_y to dst_y, overlap is fine */
+void canvas_move_rows(VGA_WINDOW * wnd, int dst_y, int src_y, int count)
+{
+    int width = wnd->canvas.bound.width;
+
+    /* whole bands just trade places, the ones pushed out land in the
+     * vacated rows just like stale pixels would */
+    if(dst_y % BAND_HEIGHT == 0 && src_y % BAND_HEIGHT == 0 &&
+        count % BAND_HEIGHT == 0 && dst_y != src_y) {
+
+        int lo = (dst_y < src_y ? dst_y : src_y) / BAND_HEIGHT;
+        int hi = ((dst_y > src_y ? dst_y : src_y) + count) / BAND_HEIGHT - 1;
+        int shift = m_abs(dst_y - src_y) / BAND_HEIGHT;
+
+        if(dst_y < src_y) {
+            canvas_reverse_bands(wnd, lo, lo + shift - 1);
+            canvas_reverse_bands(wnd, lo + shift, hi);
+        } else {
+            canvas_reverse_bands(wnd, lo, hi - shift);
+            canvas_reverse_bands(wnd, hi - shift + 1, hi);
+        }
+        canvas_reverse_bands(wnd, lo, hi);
+        return;
+    }
+
+    for(int i = 0; i < count; i++) {
+        int row = dst_y > src_y ? count - 1 - i : i;
+        canvas_copy_row(wnd, 0, dst_y + row, 0, src_y + row, width);
+    }
+}
+
+/* moves the canvas area src so its corner lands on dst_x/dst_y */
+void canvas_move_rect(VGA_WINDOW * wnd, BOUND * src, int dst_x, int dst_y)
+{
+    int width = wnd->canvas.bound.width;
+    int dy = dst_y - src->y;
+
+    if(src->x == 0 && dst_x == 0 && src->width == width) {
+        canvas_move_rows(wnd, dst_y, src->y, src->height);
+        return;
+    }
+
+    for(int i = 0; i < src->height; i++) {
+        int y = dy > 0 ? src->y + src->height - 1 - i : src->y + i;
+        canvas_copy_row(wnd, dst_x, y + dy, src->x, y, src->width);
+    }
+}
+
+/* fills r with color, bands it covers completely go back to solid */
+void canvas_fill_rect(VGA_WINDOW * wnd, BOUND * r, int color)
+{
+    CANVAS * c = &(wnd->canvas);
+
+    for(int y = r->y; y < r->y+r->height; y++) {
+        int band = y / BAND_HEIGHT;
+        int band_y = band * BAND_HEIGHT;
+        int band_h = c->bound.height - band_y < BAND_HEIGHT ?
+            c->bound.height - band_y : BAND_HEIGHT;
+
+        if(r->x == 0 && r->width == c->bound.width && y == band_y &&
+            r->y+r->height >= band_y + band_h) {
+            if(c->band_buffer[band]) {
+                free(c->band_buffer[band]);
+                c->band_buffer[band] = NULL;
+            }
+            c->band_color[band] = color;
+            y += band_h - 1;
+            continue;
+        }
+
+        if(c->band_buffer[band] == NULL && c->band_color[band] == color)
+            continue;
+
+        int * row = canvas_row(wnd, y);
+        if(row == NULL)
+            continue;
+        for(int x = r->x; x < r->x+r->width; x++)
+            row[x] = color;
+    }
+}
+
+void move_ints(int * dst, int * src, int n)
+{
+    if(dst < src) {
+        for(int i = 0; i < n; i++)
+            dst[i] = src[i];
+    } else if(dst > src) {
+        for(int i = n - 1; i >= 0; i--)
+            dst[i] = src[i];
+    }
+}
+
+/* true if the window owns every pixel of screen area b */
+int bound_owned_by(VGA_WINDOW * wnd, BOUND * b)
+{
+    BOUND screen = screen_bound();
+
+    if(!bound_contains_within(b, &screen))
+        return 0;
+
+    for(int ty = b->y / TILE_SIZE; ty <= (b->y+b->height-1) / TILE_SIZE; ty++) {
+        for(int tx = b->x / TILE_SIZE; tx <= (b->x+b->width-1) / TILE_SIZE; tx++) {
+
+            int owner = tile_owner[ty * g_tiles_x + tx];
+            if(owner == wnd->slot)
+                continue;
+            if(owner != TILE_MIXED)
+                return 0;
+
+            BOUND tb = create_bound(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+            tb = get_intersection(&tb, b);
+            for(int y = tb.y; y < tb.y+tb.height; y++)
+                for(int x = tb.x; x < tb.x+tb.width; x++)
+                    if(owner_map[y * g_fb.width + x] != wnd->slot)
+                        return 0;
+        }
+    }
+    return 1;
+}
+
+void bring_window_forward(int window_id)
+{
+    VGA_WINDOW * wnd = get_window(window_id);
+	if(wnd == NULL)
+		return;
+
+    if(wnd == window_list_head)
+        return;
+
+    remove_window_from_list(wnd);
+    add_window_to_list(wnd);
+}
+
+/********************************************************************************
+ *                             QUADTREE FUNCTIONS                               *
+ * *****************************************************************************/
+
+BOUND create_bound(int x, int y, int width, int height)
+{
+    BOUND bound;
+    bound.x = x;
+    bound.y = y;
+    bound.width = width;
+    bound.height = height;
+    return bound;
+}
+
+int bound_contains(BOUND * b, int x, int y)
+{
+    if( (x >= b->x) && (x < b->x+b->width) ) {
+        if( (y >= b->y) && (y < b->y+b->height) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int bound_intersects(BOUND * a, BOUND * b)
+{
+    if(a->x >= (b->x+b->width) || b->x >= (a->x+a->width))
+        return 0;
+
+    if(a->y >= (b->y+b->height) || b->y >= (a->y+a->height))
+        return 0;
+
+    return 1;
+}
+
+int bound_contains_within(BOUND * in, BOUND * out)
+{
+    if( (in->x >= out->x) && (in->x+in->width <= out->x+out->width) ) {
+        if( (in->y >= out->y) && (in->y+in->height <= out->y+out->height) )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+BOUND get_intersection(BOUND * a, BOUND * b)
+{
+    BOUND intr;
+
+    // find x
+    if(a->x >= b->x)
+        intr.x = a->x;
+    else
+        intr.x = b->x;
+
+    // find y
+    if(a->y >= b->y)
+        intr.y = a->y;
+    else
+        intr.y = b->y;
+
+    // find width
+    if((a->x+a->width) <= (b->x+b->width))
+        intr.width = (a->x+a->width)-intr.x;
+    else
+        intr.width = (b->x+b->width)-intr.x;
+
+    // find height
+    if((a->y+a->height) <= (b->y+b->height))
+        intr.height = (a->y+a->height)-intr.y;
+    else
+        intr.height = (b->y+b->height)-intr.y;
+
+    // ret
+    return intr;
+}
+
+QNODE * create_qnode(int x, int y, int width, int height)
+{
+    QNODE * q = malloc( sizeof(QNODE) );
+    if(q == NULL)
+        return NULL;
+    q->hidden = 0;
+    q->children = 0;
+    q->bound.x = x;
+	q->bound.y = y;
+	q->bound.width = width;
+	q->bound.height = height;
+    q->ne = NULL;
+    q->nw = NULL;
+    q->se = NULL;
+    q->sw = NULL;
+    return q;
+}
+
+void reset_root(QNODE * root)
+{
+    destroy_children(root);
+    root->hidden = 0;
+    root->children = 0;
+}
+
+QNODE * destroy_qnode(QNODE * q)
+{
+    if(q) {
+        destroy_children(q);
+        free(q);
+        q = NULL;
+    }
+    return q;
+}
+
+void destroy_children(QNODE * q)
+{
+    if(q->children > 0) {
+        if (q->nw)
+            q->nw = destroy_qnode(q->nw);
+        if (q->ne)
+            q->ne = destroy_qnode(q->ne);
+        if (q->se)
+            q->se = destroy_qnode(q->se);
+        if (q->sw)
+            q->sw = destroy_qnode(q->sw);
+        q->children = 0;
+    }
+}
+
+int search_qtree(QNODE * q, int x, int y)
+{
+    if (q == NULL)
+        return 0;
+
+    if (q->hidden == 1) {
+        return 1;
+    }
+    else {
+        if (q->nw && bound_contains(&(q->nw->bound), x, y))
+            return search_qtree(q->nw, x, y);
+        if (q->ne && bound_contains(&(q->ne->bound), x, y))
+            return search_qtree(q->ne, x, y);
+        if (q->sw && bound_contains(&(q->sw->bound), x, y))
+            return search_qtree(q->sw, x, y);
+        if (q->se && bound_contains(&(q->se->bound), x, y))
+            return search_qtree(q->se, x, y);
+    }
+    return 0;
 }
 
-/**************************************************************
- *                    API : DRAW PIXEL                        *
- *************************************************************/
+void subdivide(QNODE * q, BOUND b)
+{
+
+    int x = q->bound.x;
+    int y = q->bound.y;
+    int w = q->bound.width;
+    int h = q->bound.height;
+
+    BOUND nw = create_bound(x,y,(w/2),(h/2));
+    BOUND ne = create_bound(x+(w/2),y,(w/2),(h/2));
+    BOUND sw = create_bound(x,y+(h/2),(w/2),(h/2));
+    BOUND se = create_bound(x+(w/2),y+(h/2),(w/2),(h/2));
+
+    
+    if (bound_intersects(&(nw),&b)) {
+        if(!q->nw) {
+            q->nw = create_qnode(nw.x,nw.y,nw.width,nw.height);
+            if(!q->nw) {
+                g_qtree_failed = 1;
+                return;
+            }
+            q->children++;
+        }
+        check_qnode(q->nw, b);
+    }
+
+    if (bound_intersects(&(ne),&b)) {
+        if(!q->ne) {
+            q->ne = create_qnode(ne.x,ne.y,ne.width,ne.height);
+            if(!q->ne) {
+                g_qtree_failed = 1;
+                return;
+            }
+            q->children++;
+        }
+        check_qnode(q->ne, b);
+    }
+
+    if (bound_intersects(&(sw),&b)) {
+        if(!q->sw) {
+            q->sw = create_qnode(sw.x,sw.y,sw.width,sw.height);
+            if(!q->sw) {
+                g_qtree_failed = 1;
+                return;
+            }
+            q->children++;
+        }
+        check_qnode(q->sw, b);
+    }
+
+    if (bound_intersects(&(se),&b)) {
+        if(!q->se) {
+            q->se = create_qnode(se.x,se.y,se.width,se.height);
+            if(!q->se) {
+                g_qtree_failed = 1;
+                return;
+            }
+            q->children++;
+        }
+        check_qnode(q->se, b);
+    }
+}
 
-void draw_pixel (PARAM_VGA_DRAW_PIXEL * params)
+void check_qnode(QNODE * q, BOUND b)
 {
-    VGA_WINDOW * wnd = get_window(params->window_id);
-	if(wnd == NULL)
-		return;
-
-	set_canvas_pixel(wnd, params->x, params->y, params->color);
+    if(g_qtree_failed)
+        return;
 
-    vga_draw_canvas(wnd);
+    if(bound_contains_within(&(q->bound), &(b))) {
+        q->hidden = 1;
+    }
+    else if(bound_intersects(&(q->bound), &b)) {
+        subdivide(q, b);
+    }
 }
 
- /*************************************************************
- *                      API : DRAW TEXT                       * 
- *************************************************************/
-
-void draw_text (PARAM_VGA_DRAW_TEXT * params) 
+/* empties every tree, giving windows created under another backend
+ * their root square first */
+void reset_qtrees()
 {
-    VGA_WINDOW * wnd = get_window(params->window_id);
-	if(wnd == NULL)
-		return;
+    VGA_WINDOW * w_ptr = window_list_head;
 
-	/* print string */
-	draw_string(wnd, params->x, params->y, params->bg_color, params->fg_color, params->text);
-    vga_draw_canvas(wnd);
+    while(w_ptr != NULL){
+        if(w_ptr->root)
+            reset_root(w_ptr->root);
+        else
+            w_ptr->root = create_qnode(w_ptr->frame.bound.x, w_ptr->frame.bound.y,
+                w_ptr->lq.size, w_ptr->lq.size);
+        if(w_ptr->root == NULL)
+            g_qtree_failed = 1;
+        w_ptr = w_ptr->next;
+    }
 }
 
- /*************************************************************
- *                     API : DRAW LINE                        *
- *************************************************************/
+void release_qtrees()
+{
+    VGA_WINDOW * w_ptr = window_list_head;
 
-void draw_line (PARAM_VGA_DRAW_LINE * params)
+    while(w_ptr != NULL){
+        w_ptr->root = destroy_qnode(w_ptr->root);
+        w_ptr = w_ptr->next;
+    }
+}
+
+void build_quadtrees()
 {
+    if(g_occlusion_backend == OCCLUSION_LINEAR_QTREE) {
+        build_lqtrees();
+        return;
+    }
 
-    VGA_WINDOW * wnd = get_window(params->window_id);
-	if(wnd == NULL)
-		return;
+    /* the owner map backend keeps no per-window nodes */
+    if(g_occlusion_backend != OCCLUSION_QUADTREE)
+        return;
 
-	int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
+    if(!window_list_tail)
+        return;
 
-	dx = params->x1 - params->x0;
-	dy = params->y1 - params->y0;
+    g_qtree_failed = 0;
+    reset_qtrees();
 
-	dx1 = m_abs(dx);
-	dy1 = m_abs(dy);
+    VGA_WINDOW * w_ptr = window_list_tail;
+    VGA_WINDOW * f_ptr;
 
-	px = 2 * dy1 - dx1;
-	py = 2 * dx1 - dy1;
+    while(w_ptr != NULL) {
 
-	if (dy1 <= dx1) {
+        f_ptr = w_ptr->prev;
+        while(f_ptr != NULL && w_ptr->root && !w_ptr->minimized) {
+            if(!f_ptr->minimized)
+                check_qnode(w_ptr->root, 
+                    get_intersection(
+                        &(w_ptr->frame.bound), 
+                        &(f_ptr->frame.bound)));
+            f_ptr = f_ptr->prev;
+        }
+        w_ptr = w_ptr->prev;
+    }
+}
 
-		if (dx >= 0) {
-			x = params->x0;
-			y = params->y0;
-			xe = params->x1;
-		} else {
-			x = params->x1;
-			y = params->y1;
-			xe = params->x0;
-		}
+void set_occlusion_backend(int backend)
+{
+    g_occlusion_backend = backend;
 
-		set_canvas_pixel(wnd, x, y, params->color);
+    /* release the trees when they are no longer consulted */
+    if(backend != OCCLUSION_QUADTREE)
+        release_qtrees();
+    if(backend != OCCLUSION_LINEAR_QTREE)
+        release_lqtrees();
 
-		for (i = 0; x < xe; i++) {
-			x += 1;
+    build_quadtrees();
+}
 
-			if (px < 0) {
-				px = px + 2 * dy1;
-			} else {
-				if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) {
-					y += 1;
-				} else {
-					y -= 1;
-				}
-				px = px + 2 * (dy1 - dx1);
-			}
+int count_qnodes(QNODE * q)
+{
+    if(q == NULL)
+        return 0;
 
-			set_canvas_pixel(wnd, x, y, params->color);
-		}
+    return 1 + count_qnodes(q->nw) + count_qnodes(q->ne) +
+        count_qnodes(q->sw) + count_qnodes(q->se);
+}
 
-	} else {
+/********************************************************************************
+ *                           LINEAR QUADTREE FUNCTIONS                          *
+ * *****************************************************************************/
 
-		if (dy >= 0) {
-			x = params->x0;
-			y = params->y0;
-			ye = params->y1;
-		} else {
-			x = params->x1;
-			y = params->y1;
-			ye = params->y0;
-		}
+/* windows in front of the one being built, clipped to its frame */
+BOUND lq_occluders[MAX_WINDOWS];
 
-		set_canvas_pixel(wnd, x, y, params->color);
+/* reserves n contiguous nodes, the array is kept between builds */
+int lq_alloc(LQTREE * t, int n)
+{
+    if(t->count + n > t->capacity) {
+        int capacity = t->capacity ? t->capacity : 64;
+        while(capacity < t->count + n)
+            capacity *= 2;
+
+        int * nodes = malloc(capacity * sizeof(int));
+        if(nodes == NULL)
+            return -1;
+
+        move_ints(nodes, t->nodes, t->count);
+        if(t->nodes)
+            free(t->nodes);
+        t->nodes = nodes;
+        t->capacity = capacity;
+    }
 
-		for (i = 0; y < ye; i++) {
-			y += 1;
+    int first = t->count;
+    t->count += n;
+    return first;
+}
 
-			if (py < 0) {
-				py = py + 2 * dx1;
-			} else {
-				if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) {
-					x += 1;
-				} else {
-					x -= 1;
-				}
-				py = py + 2 * (dx1 - dy1);
-			}
+/* occ holds the n occluders that reach the parent, those that reach this
+ * square are moved to the front so its children only look at them */
+void lq_build_node(LQTREE * t, int node, int x, int y, int size, BOUND * occ, int n)
+{
+    BOUND b = create_bound(x, y, size, size);
+    int m = 0;
 
-            set_canvas_pixel(wnd, x, y, params->color);
-			
-		}
+    for(int i = 0; i < n; i++) {
+        if(!bound_intersects(&b, &occ[i]))
+            continue;
 
-	}
-    vga_draw_canvas(wnd);
-}
+        if(bound_contains_within(&b, &occ[i]) || size == 1) {
+            t->nodes[node] = -1;
+            return;
+        }
 
- /*************************************************************
- *                     API : CHANGE WINDOW                    *
- *************************************************************/
+        BOUND tmp = occ[m];
+        occ[m++] = occ[i];
+        occ[i] = tmp;
+    }
 
- void change_window(PARAM_VGA_CHANGE_FOCUS * params)
- {
-    bring_window_forward(params->window_id);
-    build_quadtrees();
-    vga_render_windows();
- }
+    t->nodes[node] = 0;
+    if(m == 0)
+        return;
 
-/**************************************************************
- *                 PIXEL DRAWING UTILITIES                    *
- *************************************************************/
+    int first = lq_alloc(t, 4);
+    if(first < 0)
+        return;
 
-void clear_screen()
-{
-	for(int x = 0; x < SCREEN_WIDTH; x++)
-		for(int y = 0; y < SCREEN_HEIGHT; y++)
-			poke_pixel(x, y, BLACK);
+    t->nodes[node] = first;
+
+    int half = size / 2;
+    for(int q = 0; q < 4; q++)
+        lq_build_node(t, first + q, x + (q & 1) * half, y + (q >> 1) * half, half, occ, m);
 }
 
-void set_pixel (VGA_WINDOW * window, int x, int y, int color)
+/* rebuilds w's tree in one pass from every window in front of it, so each
+ * block of children lands right after the blocks of its ancestors */
+void lq_build(VGA_WINDOW * w)
 {
-	// check screen boundary
+    LQTREE * t = &(w->lq);
+    int n = 0;
 
-	// check quadtree
-	if(search_qtree(window->root, x, y) == 0)
-		poke_pixel(x, y, color);
-}
+    t->count = 0;
+    if(lq_alloc(t, 1) < 0)
+        return;
+    t->nodes[0] = 0;
 
-void poke_pixel (int x, int y, int color)
-{
-	poke_b( (VIDEO_BASE_ADDRESS + y * SCREEN_WIDTH + x), color);
+    if(w->minimized)
+        return;
+
+    for(VGA_WINDOW * f = w->prev; f != NULL; f = f->prev) {
+        if(f->minimized || !bound_intersects(&(w->frame.bound), &(f->frame.bound)))
+            continue;
+        lq_occluders[n++] = get_intersection(&(w->frame.bound), &(f->frame.bound));
+    }
+
+    lq_build_node(t, 0, w->frame.bound.x, w->frame.bound.y, t->size, lq_occluders, n);
 }
 
-int m_abs (int a) 
+void lq_release(VGA_WINDOW * w)
 {
-	return a < 0 ? -a : a;
+    if(w->lq.nodes)
+        free(w->lq.nodes);
+    w->lq.nodes = NULL;
+    w->lq.count = 0;
+    w->lq.capacity = 0;
 }
 
-void draw_string (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, const char * str) {
+/* walks down by the bits of the offset into the root square, each level
+ * halving the bit it tests, until it reaches a leaf */
+int search_lqtree(VGA_WINDOW * w, int x, int y)
+{
+    LQTREE * t = &(w->lq);
+    unsigned dx = x - w->frame.bound.x;
+    unsigned dy = y - w->frame.bound.y;
 
-	while (*(str) != '\0') {
-		draw_character(wnd, x, y, bg_color, fg_color, *(str));
-		str++;
-		x+=8;
-	}
-}
+    if(t->count == 0 || dx >= (unsigned) t->size || dy >= (unsigned) t->size)
+        return 0;
 
-void draw_character (VGA_WINDOW * wnd, int x, int y, int bg_color, int fg_color, char c) {
+    unsigned half = t->size >> 1;
+    int v = t->nodes[0];
 
-	int i, n;
-	unsigned char b;
+    while(v > 0) {
+        v = t->nodes[v + ((dx & half) ? 1 : 0) + ((dy & half) ? 2 : 0)];
+        half >>= 1;
+    }
+    return v < 0;
+}
 
-	for (i = 0; i < FONT_SIZE; i++) {
+void build_lqtrees()
+{
+    for(VGA_WINDOW * w_ptr = window_list_head; w_ptr != NULL; w_ptr = w_ptr->next)
+        lq_build(w_ptr);
+}
 
-		b = g_8x8_font[(((int)c)*FONT_SIZE)+i];
+void release_lqtrees()
+{
+    for(VGA_WINDOW * w_ptr = window_list_head; w_ptr != NULL; w_ptr = w_ptr->next)
+        lq_release(w_ptr);
+}
 
-		for (n = 0; n < FONT_SIZE; n++) {
+/********************************************************************************
+ *                               CONSOLE FUNCTIONS                              *
+ * *****************************************************************************/
 
-			if ((b>>n&1)) {
-				set_canvas_pixel(wnd, x+FONT_SIZE-n-1, y+i, fg_color);
-			} else {
-				set_canvas_pixel(wnd, x+FONT_SIZE-n-1, y+i, bg_color);
-			}
-		}
-	}
-}
+/* writes one character at the cursor, only marking the cell dirty if
+ * what it shows actually changes */
+void console_put(VGA_WINDOW * wnd, char c, int fg, int bg)
+{
+    CONSOLE * con = wnd->console;
 
+    if(c == '\n') {
+        console_newline(wnd);
+        return;
+    }
 
-/**************************************************************
- *               WINDOW MANAGEMENT FUNCTIONS                  *
- *************************************************************/
+    if(c == '\r') {
+        con->cursor_x = 0;
+        return;
+    }
 
-VGA_WINDOW * get_window(int id)
-{
-    VGA_WINDOW * w_ptr = window_list_head;
-    while(w_ptr != NULL) {
-        if(w_ptr->id == id)
-            break;
-        w_ptr = w_ptr->next;
+    int row = con->cursor_y;
+    int col = con->cursor_x;
+    CELL * cell = con->cells + row * con->cols + col;
+
+    if(cell->c != c || cell->fg != fg || cell->bg != bg) {
+        cell->c = c;
+        cell->fg = fg;
+        cell->bg = bg;
+        cell->dirty = 1;
+        if(col < con->dirty_lo[row])
+            con->dirty_lo[row] = col;
+        if(col > con->dirty_hi[row])
+            con->dirty_hi[row] = col;
     }
-    return w_ptr;
+
+    /* wrap at the right edge */
+    if(++con->cursor_x == con->cols)
+        console_newline(wnd);
 }
 
-void vga_render_windows()
+/* moves the cursor to the next line, scrolling once the bottom is passed */
+void console_newline(VGA_WINDOW * wnd)
 {
-    clear_screen();
-    if(!window_list_head)
+    CONSOLE * con = wnd->console;
+
+    con->cursor_x = 0;
+    if(++con->cursor_y < con->rows)
         return;
 
-    VGA_WINDOW * w_ptr = window_list_head;
-    while(w_ptr != NULL) {
-        vga_draw_window(w_ptr);
-        w_ptr = w_ptr->next;
+    con->cursor_y = con->rows - 1;
+
+    /* rows keep their pixels and dirty marks as they move up */
+    for(int i = 0; i < (con->rows - 1) * con->cols; i++)
+        con->cells[i] = con->cells[i + con->cols];
+    for(int row = 0; row < con->rows - 1; row++) {
+        con->dirty_lo[row] = con->dirty_lo[row + 1];
+        con->dirty_hi[row] = con->dirty_hi[row + 1];
+    }
+    scroll_region(wnd, create_bound(0, 0, wnd->canvas.bound.width,
+        wnd->canvas.bound.height), 0, -FONT_SIZE, BLACK);
+
+    /* scroll_region cleared the new bottom row to black, redraw it as
+     * blank cells so it takes on their background color */
+    int last = con->rows - 1;
+    for(int col = 0; col < con->cols; col++) {
+        CELL * cell = con->cells + last * con->cols + col;
+        cell->c = ' ';
+        cell->dirty = 1;
     }
+    con->dirty_lo[last] = 0;
+    con->dirty_hi[last] = con->cols - 1;
 }
 
-void vga_draw_frame(VGA_WINDOW * window)
+/* rasterizes the dirty cells into the canvas and damages just those */
+void console_flush(VGA_WINDOW * wnd)
 {
-	BOUND fb = window->frame.bound;
+    CONSOLE * con = wnd->console;
 
-	for(int x = fb.x; x < fb.x+fb.width; x++)
-		for(int y = fb.y; y < fb.y+10; y++)
-			set_pixel(window, x, y, WHITE);
-    
-    for(int y = fb.y; y < fb.y+fb.height; y++)
-        set_pixel(window, fb.x, y, WHITE);
+    for(int row = 0; row < con->rows; row++) {
+        if(con->dirty_lo[row] > con->dirty_hi[row])
+            continue;
 
-    for(int y = fb.y; y < fb.y+fb.height; y++)
-        set_pixel(window, fb.x+fb.width-1, y, WHITE);
+        for(int col = con->dirty_lo[row]; col <= con->dirty_hi[row]; col++) {
+            CELL * cell = con->cells + row * con->cols + col;
+            if(!cell->dirty)
+                continue;
 
-    for(int x = fb.x; x < fb.x+fb.width; x++)
-        set_pixel(window, x, fb.y+fb.height-1, WHITE);
+            draw_character(wnd, col * FONT_SIZE, row * FONT_SIZE,
+                cell->bg, cell->fg, cell->c);
+            damage_canvas(wnd, col * FONT_SIZE, row * FONT_SIZE, FONT_SIZE, FONT_SIZE);
+            cell->dirty = 0;
+        }
 
-    draw_frame_title(window);
+        con->dirty_lo[row] = con->cols;
+        con->dirty_hi[row] = -1;
+    }
 }
 
-void vga_draw_canvas(VGA_WINDOW * window)
+void destroy_console(CONSOLE * con)
 {
-	BOUND cb = window->canvas.bound;
-
-	for(int x = 0; x < cb.width; x++)
-		for(int y = 0; y < cb.height; y++)
-			set_pixel(window, x+cb.x, y+cb.y, get_canvas_pixel(window, x, y));
-        
+    free(con->cells);
+    free(con->dirty_lo);
+    free(con->dirty_hi);
+    free(con);
 }
 
-void vga_draw_window(VGA_WINDOW * window)
+/********************************************************************************
+ *                              OWNER MAP FUNCTIONS                             *
+ * *****************************************************************************/
+
+int alloc_window_slot(VGA_WINDOW * w)
 {
-	vga_draw_frame(window);
-	vga_draw_canvas(window);
+    for(int slot = 1; slot <= MAX_WINDOWS; slot++) {
+        if(window_slots[slot] == NULL) {
+            window_slots[slot] = w;
+            w->slot = slot;
+            return slot;
+        }
+    }
+    return 0;
 }
 
-/* used to add a new window to the global window list */
-void add_window_to_list(VGA_WINDOW * w)
+void free_window_slot(int slot)
 {
-    if(!window_list_head) {
-        window_list_head = w;
-        window_list_tail = w;
-    } else {
-        w->next = window_list_head;
-        window_list_head->prev = w;
-        window_list_head = w;
-    }
+    window_slots[slot] = NULL;
 }
 
-int get_canvas_pixel(VGA_WINDOW * wnd, int x, int y)
+/* marks every screen pixel in b as owned by slot */
+void owner_map_fill(BOUND * b, int slot)
 {
-    return *(wnd->canvas.buffer + y * wnd->canvas.bound.width + x);
+    owner_map_write(b, slot);
+    tile_map_update(b);
 }
 
-void set_canvas_pixel(VGA_WINDOW * wnd, int x, int y, int color)
-{
-    if(x < 0 || x > wnd->canvas.bound.width-1)
-        return;
-    if(y < 0 || y > wnd->canvas.bound.height-1)  
-        return;
-    *(wnd->canvas.buffer + y * wnd->canvas.bound.width + x) = color;
+/* recomputes the owners in b by painting the windows bottom to top */
+void owner_map_repaint(BOUND * b)
+{
+    owner_map_write(b, DESKTOP_SLOT);
+
+    VGA_WINDOW * w_ptr = window_list_tail;
+    while(w_ptr != NULL) {
+        if(!w_ptr->minimized && bound_intersects(b, &(w_ptr->frame.bound))) {
+            BOUND r = get_intersection(b, &(w_ptr->frame.bound));
+            owner_map_write(&r, w_ptr->slot);
+        }
+        w_ptr = w_ptr->prev;
+    }
+
+    tile_map_update(b);
 }
 
-void bring_window_forward(int window_id)
+/* writes the owner map without touching the tile classes */
+void owner_map_write(BOUND * b, int slot)
 {
-    VGA_WINDOW * wnd = get_window(window_id);
-	if(wnd == NULL)
-		return;
+    BOUND screen = screen_bound();
 
-    if(wnd == window_list_head)
+    if(!bound_intersects(b, &screen))
         return;
 
-    if(wnd == window_list_tail)
-        window_list_tail = wnd->prev;
+    BOUND r = get_intersection(b, &screen);
 
-    wnd->prev->next = wnd->next;
-    wnd->next->prev = wnd->prev;
-    wnd->next = window_list_head;
-    window_list_head->prev = wnd;
-    wnd->prev = NULL;
-    window_list_head = wnd;
+    for(int y = r.y; y < r.y+r.height; y++) {
+        unsigned char * row = owner_map + y * g_fb.width;
+        for(int x = r.x; x < r.x+r.width; x++)
+            row[x] = slot;
+    }
 }
 
-/********************************************************************************
- *                             QUADTREE FUNCTIONS                               *
- * *****************************************************************************/
-
-BOUND create_bound(int x, int y, int width, int height)
+/* reclassifies every tile that b touches from the owner map */
+void tile_map_update(BOUND * b)
 {
-    BOUND bound;
-    bound.x = x;
-    bound.y = y;
-    bound.width = width;
-    bound.height = height;
-    return bound;
-}
+    BOUND screen = screen_bound();
 
-int bound_contains(BOUND * b, int x, int y)
-{
-    if( (x >= b->x) && (x < b->x+b->width) ) {
-        if( (y >= b->y) && (y < b->y+b->height) ) {
-            return 1;
+    if(!bound_intersects(b, &screen))
+        return;
+
+    BOUND r = get_intersection(b, &screen);
+
+    for(int ty = r.y / TILE_SIZE; ty <= (r.y+r.height-1) / TILE_SIZE; ty++) {
+        for(int tx = r.x / TILE_SIZE; tx <= (r.x+r.width-1) / TILE_SIZE; tx++) {
+
+            BOUND tb = create_bound(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+            tb = get_intersection(&tb, &screen);
+
+            int owner = owner_map[tb.y * g_fb.width + tb.x];
+            for(int y = tb.y; y < tb.y+tb.height && owner != TILE_MIXED; y++) {
+                unsigned char * row = owner_map + y * g_fb.width;
+                for(int x = tb.x; x < tb.x+tb.width; x++) {
+                    if(row[x] != owner) {
+                        owner = TILE_MIXED;
+                        break;
+                    }
+                }
+            }
+            tile_owner[ty * g_tiles_x + tx] = owner;
         }
     }
-    return 0;
 }
 
-int bound_intersects(BOUND * a, BOUND * b)
+/* reclassifies the windows whose frame touches b */
+void update_visibility(BOUND * b)
 {
-    if(a->x >= (b->x+b->width) || b->x >= (a->x+a->width))
-        return 0;
-
-    if(a->y >= (b->y+b->height) || b->y >= (a->y+a->height))
-        return 0;
-
-    return 1;
-}
+    BOUND screen = screen_bound();
 
-int bound_contains_within(BOUND * in, BOUND * out)
-{
-    if( (in->x >= out->x) && (in->x+in->width <= out->x+out->width) ) {
-        if( (in->y >= out->y) && (in->y+in->height <= out->y+out->height) )
-        {
-            return 1;
+    VGA_WINDOW * w_ptr = window_list_head;
+    while(w_ptr != NULL) {
+        if(bound_intersects(b, &(w_ptr->frame.bound))) {
+            if(w_ptr->minimized || !bound_intersects(&(w_ptr->frame.bound), &screen)) {
+                w_ptr->visibility = VIS_HIDDEN;
+            } else {
+                BOUND fb = get_intersection(&(w_ptr->frame.bound), &screen);
+                int owned = count_owned(w_ptr, &fb);
+                if(owned == 0)
+                    w_ptr->visibility = VIS_HIDDEN;
+                else if(owned == fb.width * fb.height)
+                    w_ptr->visibility = VIS_FULL;
+                else
+                    w_ptr->visibility = VIS_PARTIAL;
+            }
         }
+        w_ptr = w_ptr->next;
     }
-    return 0;
 }
 
-BOUND get_intersection(BOUND * a, BOUND * b)
+/* number of pixels in screen area b the window owns */
+int count_owned(VGA_WINDOW * wnd, BOUND * b)
 {
-    BOUND intr;
+    int owned = 0;
 
-    // find x
-    if(a->x >= b->x)
-        intr.x = a->x;
-    else
-        intr.x = b->x;
+    for(int ty = b->y / TILE_SIZE; ty <= (b->y+b->height-1) / TILE_SIZE; ty++) {
+        for(int tx = b->x / TILE_SIZE; tx <= (b->x+b->width-1) / TILE_SIZE; tx++) {
 
-    // find y
-    if(a->y >= b->y)
-        intr.y = a->y;
-    else
-        intr.y = b->y;
+            int owner = tile_owner[ty * g_tiles_x + tx];
+            if(owner != wnd->slot && owner != TILE_MIXED)
+                continue;
 
-    // find width
-    if((a->x+a->width) <= (b->x+b->width))
-        intr.width = (a->x+a->width)-intr.x;
-    else
-        intr.width = (b->x+b->width)-intr.x;
+            BOUND tb = create_bound(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+            tb = get_intersection(&tb, b);
 
-    // find height
-    if((a->y+a->height) <= (b->y+b->height))
-        intr.height = (a->y+a->height)-intr.y;
-    else
-        intr.height = (b->y+b->height)-intr.y;
+            if(owner == wnd->slot) {
+                owned += tb.width * tb.height;
+                continue;
+            }
 
-    // ret
-    return intr;
+            for(int y = tb.y; y < tb.y+tb.height; y++)
+                for(int x = tb.x; x < tb.x+tb.width; x++)
+                    if(owner_map[y * g_fb.width + x] == wnd->slot)
+                        owned++;
+        }
+    }
+    return owned;
 }
 
-QNODE * create_qnode(int x, int y, int width, int height)
+/********************************************************************************
+ *                               SPRITE FUNCTIONS                               *
+ * *****************************************************************************/
+
+/* restores what every shown sprite covers, topmost first */
+void sprites_hide()
 {
-    QNODE * q = malloc( sizeof(QNODE) );
-    q->hidden = 0;
-    q->children = 0;
-    q->bound.x = x;
-	q->bound.y = y;
-	q->bound.width = width;
-	q->bound.height = height;
-    q->ne = NULL;
-    q->nw = NULL;
-    q->se = NULL;
-    q->sw = NULL;
-    return q;
+    for(int i = MAX_SPRITES - 1; i >= 0; i--) {
+        SPRITE * sp = &sprites[i];
+        if(!sp->shown)
+            continue;
+
+        for(int y = 0; y < sp->bound.height; y++) {
+            for(int x = 0; x < sp->bound.width; x++) {
+                int sx = sp->bound.x + x;
+                int sy = sp->bound.y + y;
+                int k = y * sp->bound.width + x;
+                if(sp->pixels[k] != sp->color_key && sx >= 0 && sy >= 0 &&
+                    sx < g_fb.width && sy < g_fb.height)
+                    poke_raw(sx, sy, sp->save_under[k]);
+            }
+        }
+        sp->shown = 0;
+    }
+    g_sprites_shown = 0;
 }
 
-void reset_root(QNODE * root)
+/* saves what the visible sprites cover and draws them, lowest first */
+void sprites_show()
 {
-    destroy_children(root);
-    root->hidden = 0;
-    root->children = 0;
+    if(g_sprites_suspended)
+        return;
+
+    for(int i = 0; i < MAX_SPRITES; i++) {
+        SPRITE * sp = &sprites[i];
+        if(!sp->defined || !sp->visible || sp->shown)
+            continue;
+
+        for(int y = 0; y < sp->bound.height; y++) {
+            for(int x = 0; x < sp->bound.width; x++) {
+                int sx = sp->bound.x + x;
+                int sy = sp->bound.y + y;
+                int k = y * sp->bound.width + x;
+                if(sp->pixels[k] != sp->color_key && sx >= 0 && sy >= 0 &&
+                    sx < g_fb.width && sy < g_fb.height) {
+                    sp->save_under[k] = peek_raw(sx, sy);
+                    poke_raw(sx, sy, sp->pixels[k]);
+                }
+            }
+        }
+
+        g_sprite_bound = g_sprites_shown ?
+            get_union(&g_sprite_bound, &(sp->bound)) : sp->bound;
+        g_sprites_shown = 1;
+        sp->shown = 1;
+    }
 }
 
-QNODE * destroy_qnode(QNODE * q)
+/* stores a screen write in the save-under of the lowest sprite showing
+ * an opaque pixel there, sprites above it saved that sprite instead */
+int sprite_capture(int x, int y, int color)
 {
-    if(q) {
-        destroy_children(q);
-        free(q);
-        q = NULL;
+    for(int i = 0; i < MAX_SPRITES; i++) {
+        SPRITE * sp = &sprites[i];
+        if(!sp->shown || !bound_contains(&(sp->bound), x, y))
+            continue;
+
+        int k = (y - sp->bound.y) * sp->bound.width + (x - sp->bound.x);
+        if(sp->pixels[k] != sp->color_key) {
+            sp->save_under[k] = color;
+            return 1;
+        }
     }
-    return q;
+    return 0;
 }
 
-void destroy_children(QNODE * q)
+int sprites_cover_span(int x, int y, int n)
 {
-    if(q->children > 0) {
-        if (q->nw)
-            q->nw = destroy_qnode(q->nw);
-        if (q->ne)
-            q->ne = destroy_qnode(q->ne);
-        if (q->se)
-            q->se = destroy_qnode(q->se);
-        if (q->sw)
-            q->sw = destroy_qnode(q->sw);
-        q->children = 0;
-    }
+    if(!g_sprites_shown)
+        return 0;
+    if(y < g_sprite_bound.y || y >= g_sprite_bound.y + g_sprite_bound.height)
+        return 0;
+    if(x + n <= g_sprite_bound.x || x >= g_sprite_bound.x + g_sprite_bound.width)
+        return 0;
+    return 1;
 }
 
-int search_qtree(QNODE * q, int x, int y)
+/********************************************************************************
+ *                               DAMAGE FUNCTIONS                               *
+ * *****************************************************************************/
+
+/* like bound_intersects, but rectangles that only share an edge count */
+int bound_touches(BOUND * a, BOUND * b)
 {
-    if (q->hidden == 1) {
-        return 1;
-    }
-    else {
-        if (q->nw && bound_contains(&(q->nw->bound), x, y))
-            return search_qtree(q->nw, x, y);
-        if (q->ne && bound_contains(&(q->ne->bound), x, y))
-            return search_qtree(q->ne, x, y);
-        if (q->sw && bound_contains(&(q->sw->bound), x, y))
-            return search_qtree(q->sw, x, y);
-        if (q->se && bound_contains(&(q->se->bound), x, y))
-            return search_qtree(q->se, x, y);
-    }
-    return 0;
+    if(a->x > (b->x+b->width) || b->x > (a->x+a->width))
+        return 0;
+
+    if(a->y > (b->y+b->height) || b->y > (a->y+a->height))
+        return 0;
+
+    return 1;
 }
 
-void subdivide(QNODE * q, BOUND b)
+BOUND get_union(BOUND * a, BOUND * b)
 {
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = (a->x+a->width) > (b->x+b->width) ? (a->x+a->width) : (b->x+b->width);
+    int y1 = (a->y+a->height) > (b->y+b->height) ? (a->y+a->height) : (b->y+b->height);
 
-    int x = q->bound.x;
-    int y = q->bound.y;
-    int w = q->bound.width;
-    int h = q->bound.height;
+    return create_bound(x0, y0, x1-x0, y1-y0);
+}
 
-    BOUND nw = create_bound(x,y,(w/2),(h/2));
-    BOUND ne = create_bound(x+(w/2),y,(w/2),(h/2));
-    BOUND sw = create_bound(x,y+(h/2),(w/2),(h/2));
-    BOUND se = create_bound(x+(w/2),y+(h/2),(w/2),(h/2));
+/* records a screen area that changed, merging it with any damage it
+ * touches so that the list never holds overlapping rectangles */
+void add_damage(BOUND * b)
+{
+    BOUND screen = screen_bound();
 
-    
-    if (bound_intersects(&(nw),&b)) {
-        if(!q->nw) {
-            q->children++;
-            q->nw = create_qnode(nw.x,nw.y,nw.width,nw.height);
-        }
-        check_qnode(q->nw, b);
-    }
+    if(b->width <= 0 || b->height <= 0 || !bound_intersects(b, &screen))
+        return;
 
-    if (bound_intersects(&(ne),&b)) {
-        if(!q->ne) {
-            q->children++;
-            q->ne = create_qnode(ne.x,ne.y,ne.width,ne.height);
-        }
-        check_qnode(q->ne, b);
-    }
+    BOUND d = get_intersection(b, &screen);
+    int i = 0;
 
-    if (bound_intersects(&(sw),&b)) {
-        if(!q->sw) {
-            q->children++;
-            q->sw = create_qnode(sw.x,sw.y,sw.width,sw.height);
+    while(i < damage_count) {
+        if(bound_touches(&d, &damage_list[i])) {
+            d = get_union(&d, &damage_list[i]);
+            damage_list[i] = damage_list[--damage_count];
+            i = 0;
+        } else {
+            i++;
         }
-        check_qnode(q->sw, b);
     }
 
-    if (bound_intersects(&(se),&b)) {
-        if(!q->se) {
-            q->children++;
-            q->se = create_qnode(se.x,se.y,se.width,se.height);
+    /* list full, fold the new area into the entry that grows least */
+    if(damage_count == MAX_DAMAGE) {
+        int best = 0;
+        int best_area = -1;
+        for(i = 0; i < damage_count; i++) {
+            BOUND u = get_union(&d, &damage_list[i]);
+            int area = u.width * u.height;
+            if(best_area < 0 || area < best_area) {
+                best = i;
+                best_area = area;
+            }
         }
-        check_qnode(q->se, b);
+        d = get_union(&d, &damage_list[best]);
+        damage_list[best] = damage_list[--damage_count];
+        add_damage(&d);
+    } else {
+        damage_list[damage_count++] = d;
     }
+
+    if(g_present_mode == PRESENT_IMMEDIATE && !g_present_hold)
+        vga_present();
 }
 
-void check_qnode(QNODE * q, BOUND b)
+/* records damage for an area given in canvas coordinates, hidden
+ * windows only keep their canvas since a stack change that shows them
+ * again damages what it uncovers */
+void damage_canvas(VGA_WINDOW * wnd, int x, int y, int width, int height)
 {
-    if(bound_contains_within(&(q->bound), &(b))) {
-        q->hidden = 1;
-    }
-    else if(bound_intersects(&(q->bound), &b)) {
-        subdivide(q, b);
-    }
+    BOUND cb = wnd->canvas.bound;
+
+    if(wnd->visibility == VIS_HIDDEN)
+        return;
+
+    BOUND d = create_bound(cb.x + x, cb.y + y, width, height);
+
+    if(!bound_intersects(&d, &cb))
+        return;
+
+    d = get_intersection(&d, &cb);
+    add_damage(&d);
 }
 
-void reset_qtrees()
+int damage_intersects(BOUND * b)
 {
-    VGA_WINDOW * w_ptr = window_list_head;
-
-    while(w_ptr != NULL){
-        reset_root(w_ptr->root);
-        w_ptr = w_ptr->next;
-    }
+    for(int i = 0; i < damage_count; i++)
+        if(bound_intersects(b, &damage_list[i]))
+            return 1;
+    return 0;
 }
 
-void build_quadtrees()
+/* composites all pending damage to the screen */
+void vga_present()
 {
-    if(!window_list_tail)
+    /* text mode owns the planes, damage waits for graphics to return */
+    if(damage_count == 0 || g_vga_mode != VGA_MODE_13H)
         return;
 
-    reset_qtrees();
+    if(g_present_vsync)
+        wait_vretrace();
 
-    VGA_WINDOW * w_ptr = window_list_tail;
-    VGA_WINDOW * f_ptr;
+    for(int i = 0; i < damage_count; i++)
+        vga_compose_rect(&damage_list[i]);
 
-    while(w_ptr != NULL) {
+    damage_count = 0;
+}
 
-        f_ptr = w_ptr->prev;
-        while(f_ptr != NULL) {
-            check_qnode(w_ptr->root, 
-                get_intersection(
-                    &(w_ptr->frame.bound), 
-                    &(f_ptr->frame.bound)));
-            f_ptr = f_ptr->prev;
-        }
-        w_ptr = w_ptr->prev;
-    }
+unsigned long long read_tsc()
+{
+    unsigned lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long) hi << 32) | lo;
 }
 
+void wait_vretrace()
+{
+    /* let a retrace in progress finish, then wait for the next one */
+    while(inportb(VGA_INSTAT_READ) & 0x08);
+    while(!(inportb(VGA_INSTAT_READ) & 0x08));
+}
 
 /********************************************************************************
  *                                TEST PROCESS                                  *
@@ -895,7 +4251,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.create_window.y = 50;
 	msg.u.create_window.width = 100;
 	msg.u.create_window.height = 50;
-	send(vga_port, &msg);
+	vga_send(&msg);
 	unsigned int window1_id = msg.u.create_window.window_id;
 
 	// Create Window 2
@@ -905,7 +4261,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.create_window.y = 120;
 	msg.u.create_window.width = 150;
 	msg.u.create_window.height = 60;
-	send(vga_port, &msg);
+	vga_send(&msg);
 	unsigned int window2_id = msg.u.create_window.window_id;
 
 	// Create Window 3
@@ -915,7 +4271,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.create_window.y = 30;
 	msg.u.create_window.width = 100;
 	msg.u.create_window.height = 100;
-	send(vga_port, &msg);
+	vga_send(&msg);
 	unsigned int window3_id = msg.u.create_window.window_id;
 
     // Create Window 4
@@ -925,7 +4281,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.create_window.y = 70;
 	msg.u.create_window.width = 100;
 	msg.u.create_window.height = 100;
-	send(vga_port, &msg);
+	vga_send(&msg);
 	unsigned int window4_id = msg.u.create_window.window_id;
 
 	// Draw some lines in Window 1
@@ -938,7 +4294,7 @@ void vga_test (PROCESS proc, PARAM param)
 		msg.u.draw_line.x1 = 100 - x;
 		msg.u.draw_line.y1 = 49;
 		msg.u.draw_line.color = current_color++;
-		send(vga_port, &msg);
+		vga_send(&msg);
 	}
 
 	// Write some text in Window 2
@@ -949,7 +4305,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.draw_text.y = 1;
 	msg.u.draw_text.fg_color = 0x3f; // White
 	msg.u.draw_text.bg_color = 0;
-	send(vga_port, &msg);
+	vga_send(&msg);
 
 	// Write some text in Window 2 that will be clipped
 	msg.cmd = VGA_DRAW_TEXT;
@@ -959,7 +4315,7 @@ void vga_test (PROCESS proc, PARAM param)
 	msg.u.draw_text.y = 20;
 	msg.u.draw_text.fg_color = 0x3f; // White
 	msg.u.draw_text.bg_color = 0;
-	send(vga_port, &msg);
+	vga_send(&msg);
 /*
 	// Draw some random pixels in Window 3
 	msg.cmd = VGA_DRAW_PIXEL;
@@ -971,17 +4327,139 @@ void vga_test (PROCESS proc, PARAM param)
 		msg.u.draw_pixel.y = y;
 		msg.u.draw_pixel.color = current_color;
 		current_color = (current_color + 1) % 64;
-		send(vga_port, &msg);
+		vga_send(&msg);
 		}
 	}
 */
     msg.cmd = VGA_CHANGE_FOCUS;
     msg.u.change_focus.window_id = window1_id;
-    send(vga_port, &msg);
+    vga_send(&msg);
     msg.u.change_focus.window_id = window2_id;
-    send(vga_port, &msg);
+    vga_send(&msg);
     msg.u.change_focus.window_id = window3_id;
-    send(vga_port, &msg);
+    vga_send(&msg);
+
+    become_zombie();
+}
+
+/********************************************************************************
+ *                              BENCHMARK PROCESS                               *
+ * *****************************************************************************/
+
+/* right aligns v in a field of width characters */
+char * bench_field(char * buf, unsigned v, int width)
+{
+    char * p = buf + width;
+
+    *p = '\0';
+    do {
+        *(--p) = '0' + v % 10;
+        v /= 10;
+    } while (v > 0 && p > buf);
+
+    while (p > buf)
+        *(--p) = ' ';
+
+    return buf + width;
+}
+
+void vga_bench (PROCESS proc, PARAM param)
+{
+	VGA_WINDOW_MSG msg;
+	BENCH_RESULT results[9];
+	char line[64];
+
+	// Run the benchmark inside the driver
+	msg.cmd = VGA_BENCHMARK;
+	PARAM_VGA_BENCHMARK * bench = (PARAM_VGA_BENCHMARK *) &msg.u;
+	bench->results = results;
+	bench->max_results = 9;
+	vga_send(&msg);
+	int count = bench->count;
+
+	// Create a window for the results
+	msg.cmd = VGA_CREATE_WINDOW;
+	msg.u.create_window.title = "Benchmark";
+	msg.u.create_window.x = 4;
+	msg.u.create_window.y = 20;
+	msg.u.create_window.width = 312;
+	msg.u.create_window.height = 8 * (count + 1);
+	vga_send(&msg);
+	unsigned int window_id = msg.u.create_window.window_id;
+
+	// One row per resolution and window count, in thousands of cycles
+	msg.cmd = VGA_DRAW_TEXT;
+	msg.u.draw_text.window_id = window_id;
+	msg.u.draw_text.text = "   w  n clear   map qtree  cmpm  cmpq";
+	msg.u.draw_text.x = 0;
+	msg.u.draw_text.y = 0;
+	msg.u.draw_text.fg_color = 0x3f; // White
+	msg.u.draw_text.bg_color = 0;
+	vga_send(&msg);
+
+	for (int i = 0; i < count; i++) {
+		char * p = bench_field(line, results[i].width, 4);
+		p = bench_field(p, results[i].windows, 3);
+		p = bench_field(p, results[i].cycles[BENCH_CLEAR] / 1000, 6);
+		p = bench_field(p, results[i].cycles[BENCH_OWNER_MAP] / 1000, 6);
+		p = bench_field(p, results[i].cycles[BENCH_QTREE_BUILD] / 1000, 6);
+		p = bench_field(p, results[i].cycles[BENCH_COMPOSE_MAP] / 1000, 6);
+		bench_field(p, results[i].cycles[BENCH_COMPOSE_QTREE] / 1000, 6);
+
+		msg.cmd = VGA_DRAW_TEXT;
+		msg.u.draw_text.window_id = window_id;
+		msg.u.draw_text.text = line;
+		msg.u.draw_text.x = 0;
+		msg.u.draw_text.y = 8 * (i + 1);
+		vga_send(&msg);
+	}
+
+	// Pointer tree against linear tree on dense overlap
+	QTREE_BENCH_RESULT qt_results[3];
+	msg.cmd = VGA_QTREE_BENCHMARK;
+	PARAM_VGA_QTREE_BENCHMARK * qt_bench = (PARAM_VGA_QTREE_BENCHMARK *) &msg.u;
+	qt_bench->results = qt_results;
+	qt_bench->max_results = 3;
+	vga_send(&msg);
+	count = qt_bench->count;
+
+	msg.cmd = VGA_CREATE_WINDOW;
+	msg.u.create_window.title = "Quadtrees";
+	msg.u.create_window.x = 4;
+	msg.u.create_window.y = 120;
+	msg.u.create_window.width = 312;
+	msg.u.create_window.height = 8 * (count + 1);
+	vga_send(&msg);
+	window_id = msg.u.create_window.window_id;
+
+	// Node bytes, thousands of cycles to build, cycles per lookup
+	msg.cmd = VGA_DRAW_TEXT;
+	msg.u.draw_text.window_id = window_id;
+	msg.u.draw_text.text = "   n  qtbyte lqbyte qtbld lqbd qlk llk";
+	msg.u.draw_text.x = 0;
+	msg.u.draw_text.y = 0;
+	msg.u.draw_text.fg_color = 0x3f; // White
+	msg.u.draw_text.bg_color = 0;
+	vga_send(&msg);
+
+	for (int i = 0; i < count; i++) {
+		QTREE_BENCH_RESULT * r = &qt_results[i];
+		unsigned lookups = r->lookups ? r->lookups : 1;
+		char * p = bench_field(line, r->windows, 4);
+		p = bench_field(p, r->bytes[BENCH_QT_POINTER], 8);
+		p = bench_field(p, r->bytes[BENCH_QT_LINEAR], 7);
+		p = bench_field(p, r->build_cycles[BENCH_QT_POINTER] / 1000, 6);
+		p = bench_field(p, r->build_cycles[BENCH_QT_LINEAR] / 1000, 5);
+		p = bench_field(p, r->lookup_cycles[BENCH_QT_POINTER] / lookups, 4);
+		bench_field(p, r->lookup_cycles[BENCH_QT_LINEAR] / lookups, 4);
+
+		msg.cmd = VGA_DRAW_TEXT;
+		msg.u.draw_text.window_id = window_id;
+		msg.u.draw_text.text = line;
+		msg.u.draw_text.x = 0;
+		msg.u.draw_text.y = 8 * (i + 1);
+		vga_send(&msg);
+	}
 
     become_zombie();
 }